@@ -12,16 +12,26 @@
 #  include <config.h>
 #endif
 
+#include <map>
 #include <string>
 #include <sstream>
+#include <vector>
+#include <iostream>
+#include <cstdio>
 #include <cstdlib>
 
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/raw_ostream.h"
 #include "TransformationManager.h"
 #include "git_version.h"
 
 static TransformationManager *TransMgr;
 static int ErrorCode = -1;
+static bool ServerMode = false;
+static bool QueryAllInstances = false;
+static bool ListInstances = false;
+static std::vector<int> Counters;
+static std::string OutputDir;
 
 static void PrintVersion()
 {
@@ -62,6 +72,23 @@ static void PrintHelpMessage()
   llvm::outs() << "query available transformation instances for a given ";
   llvm::outs() << "transformation\n";
 
+  llvm::outs() << "  --query-all-instances: ";
+  llvm::outs() << "parse the source once and print the number of ";
+  llvm::outs() << "instances of every transformation as a JSON object ";
+  llvm::outs() << "mapping names to counts, on one line; the count of a ";
+  llvm::outs() << "transformation that crashed is -1\n";
+
+  llvm::outs() << "  --list-instances=<name>: ";
+  llvm::outs() << "perform each instance of the given transformation in ";
+  llvm::outs() << "turn, and print one JSON object per instance, on a line ";
+  llvm::outs() << "of its own, with its counter, the byte ranges ";
+  llvm::outs() << "[begin, end) of the source that it would change, and ";
+  llvm::outs() << "the change in the size of the source, e.g. ";
+  llvm::outs() << "{\"counter\": 1, \"ranges\": [[12, 20]], ";
+  llvm::outs() << "\"size_delta\": -8}. Insertions are empty ranges; ";
+  llvm::outs() << "instances that cannot be performed have an \"error\" ";
+  llvm::outs() << "member\n";
+
   llvm::outs() << "  --counter=<number>: ";
   llvm::outs() << "specify the instance of the transformation to perform\n";
 
@@ -69,8 +96,10 @@ static void PrintHelpMessage()
   llvm::outs() << "specify the ending instance of the transformation to ";
   llvm::outs() << "perform (when this option is given, clang_delta will ";
   llvm::outs() << "rewrite multiple instances [counter,to-counter] ";
-  llvm::outs() << "simultaneously. Note that currently only ";
-  llvm::outs() << "replace-function-def-with-decl supports this feature.)\n";
+  llvm::outs() << "simultaneously. If the rewrites of an instance would ";
+  llvm::outs() << "overlap those of an earlier instance in the range, or ";
+  llvm::outs() << "an instance fails, nothing is written and clang_delta ";
+  llvm::outs() << "exits with status 2, naming those instances.)\n";
 
   llvm::outs() << "  --replacement=<string>: ";
   llvm::outs() << "instead of performing normal rewriting, the candidate ";
@@ -87,6 +116,41 @@ static void PrintHelpMessage()
   llvm::outs() << "  --output=<filename>: ";
   llvm::outs() << "specify where to output the transformed source code ";
   llvm::outs() << "(default: stdout)\n";
+
+  llvm::outs() << "  --counters=<number>,<number>,...: ";
+  llvm::outs() << "parse the source once and perform the transformation ";
+  llvm::outs() << "separately for each of the given instances. The result ";
+  llvm::outs() << "for instance N is written to <dir>/N, and one line ";
+  llvm::outs() << "\"N ok\" or \"N error <code> <message>\" is printed ";
+  llvm::outs() << "per instance. Requires --output-dir.\n";
+
+  llvm::outs() << "  --output-dir=<dir>: ";
+  llvm::outs() << "specify where --counters writes its output files\n";
+
+  llvm::outs() << "  --ast-cache=<dir>: ";
+  llvm::outs() << "keep the parsed source in <dir>, in serialized form and ";
+  llvm::outs() << "keyed by its contents and the options it is parsed with, ";
+  llvm::outs() << "and load it from there instead of parsing the same ";
+  llvm::outs() << "source again in later runs. Each run appends a line ";
+  llvm::outs() << "\"hit <seconds>\" (load time), \"miss <seconds>\" or ";
+  llvm::outs() << "\"uncached <seconds>\" (parse time) to <dir>/stats. ";
+  llvm::outs() << "Sources that do not parse cleanly are not cached. ";
+  llvm::outs() << "(default: the value of CREDUCE_AST_CACHE, if set)\n";
+
+  llvm::outs() << "  --server: ";
+  llvm::outs() << "read requests from stdin, one per line, and answer each ";
+  llvm::outs() << "of them on stdout. The parsed AST is kept across requests ";
+  llvm::outs() << "until the contents of the source file change. Requests ";
+  llvm::outs() << "are tab-separated:\n";
+  llvm::outs() << "      transform <name> <counter> <to-counter|0> ";
+  llvm::outs() << "<source_filename> <output_filename>\n";
+  llvm::outs() << "      query <name> <source_filename>\n";
+  llvm::outs() << "      query-all <source_filename>\n";
+  llvm::outs() << "      stats\n";
+  llvm::outs() << "      quit\n";
+  llvm::outs() << "    and are answered with \"ok\", \"ok <number>\", ";
+  llvm::outs() << "\"ok <JSON object>\" (for query-all) or ";
+  llvm::outs() << "\"error <code> <message>\"\n";
   llvm::outs() << "\n";
 }
 
@@ -129,6 +193,12 @@ static void HandleOneArgValue(const std::string &ArgValueStr, size_t SepPos)
     TransMgr->setQueryInstanceFlag(true);
     TransMgr->setTransformationCounter(1);
   }
+  else if (!ArgName.compare("list-instances")) {
+    if (TransMgr->setTransformation(ArgValue)) {
+      Die("Invalid transformation[" + ArgValue + "]");
+    }
+    ListInstances = true;
+  }
   else if (!ArgName.compare("counter")) {
     int Val;
     std::stringstream TmpSS(ArgValue);
@@ -151,9 +221,33 @@ static void HandleOneArgValue(const std::string &ArgValueStr, size_t SepPos)
 
     TransMgr->setToCounter(Val);
   }
+  else if (!ArgName.compare("counters")) {
+    std::stringstream TmpSS(ArgValue);
+    std::string Item;
+    while (std::getline(TmpSS, Item, ',')) {
+      int Val;
+      std::stringstream ItemSS(Item);
+      if (!(ItemSS >> Val) || !ItemSS.eof() || (Val <= 0)) {
+        ErrorCode = TransformationManager::ErrorInvalidCounter;
+        Die("Invalid counters[" + ArgValueStr + "]");
+      }
+      Counters.push_back(Val);
+    }
+    if (Counters.empty()) {
+      ErrorCode = TransformationManager::ErrorInvalidCounter;
+      Die("Invalid counters[" + ArgValueStr + "]");
+    }
+    TransMgr->setTransformationCounter(Counters.front());
+  }
   else if (!ArgName.compare("output")) {
     TransMgr->setOutputFileName(ArgValue);
   }
+  else if (!ArgName.compare("output-dir")) {
+    OutputDir = ArgValue;
+  }
+  else if (!ArgName.compare("ast-cache")) {
+    TransMgr->setASTCacheDir(ArgValue);
+  }
   else if (!ArgName.compare("replacement")) {
     TransMgr->setReplacement(ArgValue);
   }
@@ -183,6 +277,12 @@ static void HandleOneNoneValueArg(const std::string &ArgStr)
     TransMgr->printTransformations();
     exit(0);
   }
+  else if (!ArgStr.compare("server")) {
+    ServerMode = true;
+  }
+  else if (!ArgStr.compare("query-all-instances")) {
+    QueryAllInstances = true;
+  }
   else {
     DieOnBadCmdArg(ArgStr);
   }
@@ -211,6 +311,230 @@ static void HandleOneArg(const char *Arg)
   }
 }
 
+static void SplitRequest(const std::string &Line,
+                         std::vector<std::string> &Fields)
+{
+  size_t Start = 0;
+  size_t Pos;
+  while ((Pos = Line.find('\t', Start)) != std::string::npos) {
+    Fields.push_back(Line.substr(Start, Pos - Start));
+    Start = Pos + 1;
+  }
+  Fields.push_back(Line.substr(Start));
+}
+
+static void ReplyError(int Code, const std::string &Message)
+{
+  // Keep the reply on a single line
+  std::string Msg(Message);
+  for (size_t I = 0; I < Msg.length(); ++I) {
+    if ((Msg[I] == '\n') || (Msg[I] == '\r'))
+      Msg[I] = ' ';
+  }
+  llvm::outs() << "error " << Code << " " << Msg << "\n";
+}
+
+// Print the instance counts of all transformations as a JSON object
+static void PrintAllInstances(const std::string &SrcFile, bool Reply)
+{
+  std::string ErrorMsg;
+  std::map<std::string, int> Counts;
+  if (!TransMgr->loadSource(SrcFile, ErrorMsg) ||
+      !TransMgr->queryAllInstances(Counts, ErrorMsg)) {
+    if (Reply) {
+      ReplyError(-1, ErrorMsg);
+      return;
+    }
+    Die(ErrorMsg);
+  }
+
+  if (Reply)
+    llvm::outs() << "ok ";
+  llvm::outs() << "{";
+  for (std::map<std::string, int>::iterator I = Counts.begin(),
+       E = Counts.end(); I != E; ++I) {
+    if (I != Counts.begin())
+      llvm::outs() << ", ";
+    llvm::outs() << "\"" << (*I).first << "\": " << (*I).second;
+  }
+  llvm::outs() << "}\n";
+}
+
+static std::string JSONString(const std::string &Str)
+{
+  std::string Quoted = "\"";
+  for (size_t I = 0; I < Str.length(); ++I) {
+    unsigned char C = Str[I];
+    if ((C == '"') || (C == '\\')) {
+      Quoted += '\\';
+      Quoted += C;
+    }
+    else if (C < 0x20) {
+      char Buf[8];
+      snprintf(Buf, sizeof(Buf), "\\u%04x", C);
+      Quoted += Buf;
+    }
+    else {
+      Quoted += C;
+    }
+  }
+  return Quoted + "\"";
+}
+
+// Print what each instance of the current transformation changes, one
+// JSON object per line
+static void PrintInstanceList()
+{
+  std::string ErrorMsg;
+  std::string SrcFile = TransMgr->getSrcFileName();
+  std::vector<TransformationManager::InstanceInfo> Instances;
+  if (!TransMgr->loadSource(SrcFile, ErrorMsg) ||
+      !TransMgr->listInstances(Instances, ErrorMsg))
+    Die(ErrorMsg);
+
+  for (std::vector<TransformationManager::InstanceInfo>::iterator
+       I = Instances.begin(), E = Instances.end(); I != E; ++I) {
+    llvm::outs() << "{\"counter\": " << (*I).Counter << ", \"ranges\": [";
+    for (size_t R = 0; R < (*I).Ranges.size(); ++R) {
+      if (R > 0)
+        llvm::outs() << ", ";
+      llvm::outs() << "[" << (*I).Ranges[R].first << ", "
+                   << (*I).Ranges[R].second << "]";
+    }
+    llvm::outs() << "], \"size_delta\": " << (*I).SizeDelta;
+    if (!(*I).ErrorMsg.empty())
+      llvm::outs() << ", \"error\": " << JSONString((*I).ErrorMsg);
+    llvm::outs() << "}\n";
+  }
+}
+
+static bool ParseCounter(const std::string &Str, int &Val)
+{
+  std::stringstream TmpSS(Str);
+  return (TmpSS >> Val) && TmpSS.eof();
+}
+
+// Handle one request of a server session. Returns false once the
+// session should end.
+static bool HandleRequest(const std::string &Line)
+{
+  std::vector<std::string> Fields;
+  SplitRequest(Line, Fields);
+  const std::string &Cmd = Fields[0];
+
+  if (!Cmd.compare("quit"))
+    return false;
+
+  if (!Cmd.compare("stats")) {
+    llvm::outs() << "ok parses=" << TransMgr->getNumParses()
+                 << " runs=" << TransMgr->getNumRuns()
+                 << " cache-hits=" << TransMgr->getNumCacheHits()
+                 << " cache-misses=" << TransMgr->getNumCacheMisses()
+                 << " load-time=" << TransMgr->getLoadTime()
+                 << " parse-time=" << TransMgr->getParseTime() << "\n";
+    return true;
+  }
+
+  TransMgr->resetRequestOptions();
+  if (!Cmd.compare("query-all") && (Fields.size() == 2)) {
+    PrintAllInstances(Fields[1], true);
+    return true;
+  }
+
+  std::string ErrorMsg;
+  int Code = -1;
+  std::string SrcFile;
+
+  if (!Cmd.compare("transform") && (Fields.size() == 6)) {
+    int Counter, To;
+    if (TransMgr->setTransformation(Fields[1])) {
+      ReplyError(-1, "Invalid transformation[" + Fields[1] + "]");
+      return true;
+    }
+    if (!ParseCounter(Fields[2], Counter) || !ParseCounter(Fields[3], To) ||
+        (Counter <= 0) || (To < 0)) {
+      ReplyError(TransformationManager::ErrorInvalidCounter,
+                 "Invalid counter[" + Fields[2] + "," + Fields[3] + "]");
+      return true;
+    }
+    TransMgr->setTransformationCounter(Counter);
+    if (To > 0)
+      TransMgr->setToCounter(To);
+    SrcFile = Fields[4];
+    TransMgr->setOutputFileName(Fields[5]);
+  }
+  else if (!Cmd.compare("query") && (Fields.size() == 3)) {
+    if (TransMgr->setTransformation(Fields[1])) {
+      ReplyError(-1, "Invalid transformation[" + Fields[1] + "]");
+      return true;
+    }
+    TransMgr->setQueryInstanceFlag(true);
+    TransMgr->setTransformationCounter(1);
+    SrcFile = Fields[2];
+  }
+  else {
+    ReplyError(-1, "Bad request[" + Line + "]");
+    return true;
+  }
+
+  if (!TransMgr->verify(ErrorMsg, Code) ||
+      !TransMgr->loadSource(SrcFile, ErrorMsg) ||
+      !TransMgr->runTransformation(ErrorMsg, Code)) {
+    ReplyError(Code, ErrorMsg);
+    return true;
+  }
+
+  if (TransMgr->getQueryInstanceFlag())
+    llvm::outs() << "ok " << TransMgr->getNumInstances() << "\n";
+  else
+    llvm::outs() << "ok\n";
+  return true;
+}
+
+// Perform the transformation once per entry of Counters, on top of a
+// single parse of the source.
+static void RunCounters()
+{
+  std::string ErrorMsg;
+  if (OutputDir.empty())
+    Die("--counters requires --output-dir");
+  if (TransMgr->getQueryInstanceFlag())
+    Die("--counters cannot be used with --query-instances");
+
+  std::string SrcFile = TransMgr->getSrcFileName();
+  if (!TransMgr->loadSource(SrcFile, ErrorMsg))
+    Die(ErrorMsg);
+
+  for (std::vector<int>::iterator I = Counters.begin(), E = Counters.end();
+       I != E; ++I) {
+    std::stringstream OutSS;
+    OutSS << OutputDir << "/" << *I;
+    int Code = -1;
+    TransMgr->setTransformationCounter(*I);
+    TransMgr->setOutputFileName(OutSS.str());
+    if (TransMgr->verify(ErrorMsg, Code) &&
+        TransMgr->runTransformation(ErrorMsg, Code)) {
+      llvm::outs() << *I << " ok\n";
+      continue;
+    }
+    llvm::sys::fs::remove(OutSS.str());
+    llvm::outs() << *I << " error " << Code << " " << ErrorMsg << "\n";
+  }
+}
+
+static void RunServer()
+{
+  std::string Line;
+  while (std::getline(std::cin, Line)) {
+    if (Line.empty())
+      continue;
+    bool KeepGoing = HandleRequest(Line);
+    llvm::outs().flush();
+    if (!KeepGoing)
+      break;
+  }
+}
+
 int main(int argc, char **argv)
 {
   TransMgr = TransformationManager::GetInstance();
@@ -218,10 +542,51 @@ int main(int argc, char **argv)
     HandleOneArg(argv[i]);
   }
 
+  if (ServerMode) {
+    RunServer();
+    TransformationManager::Finalize();
+    return 0;
+  }
+
+  if (QueryAllInstances) {
+    std::string SrcFile = TransMgr->getSrcFileName();
+    if (SrcFile.empty())
+      Die("--query-all-instances requires a source file");
+    PrintAllInstances(SrcFile, false);
+    TransformationManager::Finalize();
+    return 0;
+  }
+
+  if (ListInstances) {
+    if (TransMgr->getSrcFileName().empty())
+      Die("--list-instances requires a source file");
+    PrintInstanceList();
+    TransformationManager::Finalize();
+    return 0;
+  }
+
+  if (!Counters.empty()) {
+    RunCounters();
+    TransformationManager::Finalize();
+    return 0;
+  }
+
   std::string ErrorMsg;
   if (!TransMgr->verify(ErrorMsg, ErrorCode))
     Die(ErrorMsg);
 
+  // the AST cache is only used through a session
+  if (TransMgr->needsSession() || TransMgr->usesASTCache()) {
+    std::string SrcFile = TransMgr->getSrcFileName();
+    if (!TransMgr->loadSource(SrcFile, ErrorMsg) ||
+        !TransMgr->runTransformation(ErrorMsg, ErrorCode))
+      Die(ErrorMsg);
+    if (TransMgr->getQueryInstanceFlag())
+      TransMgr->outputNumTransformationInstances();
+    TransformationManager::Finalize();
+    return 0;
+  }
+
   if (!TransMgr->initializeCompilerInstance(ErrorMsg))
     Die(ErrorMsg);
 
@@ -0,0 +1,274 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (c) 2012, 2013, 2015, 2016 The University of Utah
+// All rights reserved.
+//
+// This file is distributed under the University of Illinois Open Source
+// License.  See the file COPYING for details.
+//
+//===----------------------------------------------------------------------===//
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "ClangDeltaSession.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#include "TransformationManager.h"
+#include "libclang_delta.h"
+
+ClangDeltaSession *ClangDeltaSession::Current = NULL;
+
+ClangDeltaSession::ClangDeltaSession(const std::string &FileName)
+  : FileName(FileName)
+{
+  TransformationManager::GetInstance()->setCrashRecovery(true);
+}
+
+ClangDeltaSession::~ClangDeltaSession()
+{
+  // The manager itself stays, along with the registered transformations,
+  // for the next session.
+  TransformationManager *TransMgr = TransformationManager::GetInstance();
+  TransMgr->resetRequestOptions();
+  TransMgr->resetSource();
+  TransMgr->setCrashRecovery(false);
+  Current = NULL;
+}
+
+ClangDeltaSession *ClangDeltaSession::create(const std::string &FileName,
+                                             const std::string &Contents,
+                                             std::string &ErrorMsg)
+{
+  if (Current) {
+    ErrorMsg = "Another clang_delta session is active!";
+    return NULL;
+  }
+  ClangDeltaSession *Session = new ClangDeltaSession(FileName);
+  Current = Session;
+  if (!Session->setSource(Contents, ErrorMsg)) {
+    delete Session;
+    return NULL;
+  }
+  return Session;
+}
+
+void ClangDeltaSession::getTransformationNames(
+       std::vector<std::string> &Names)
+{
+  TransformationManager::GetInstance()->getTransformationNames(Names);
+}
+
+bool ClangDeltaSession::setSource(const std::string &Contents,
+                                  std::string &ErrorMsg)
+{
+  return TransformationManager::GetInstance()->loadSourceBuffer(
+           FileName, Contents, ErrorMsg);
+}
+
+bool ClangDeltaSession::queryInstances(const std::string &Name,
+                                       int &NumInstances,
+                                       std::string &ErrorMsg)
+{
+  TransformationManager *TransMgr = TransformationManager::GetInstance();
+  TransMgr->resetRequestOptions();
+  if (TransMgr->setTransformation(Name)) {
+    ErrorMsg = "Invalid transformation[" + Name + "]";
+    return false;
+  }
+  TransMgr->setQueryInstanceFlag(true);
+  TransMgr->setTransformationCounter(1);
+
+  int ErrorCode = -1;
+  bool RV = TransMgr->runTransformation(ErrorMsg, ErrorCode);
+  if (RV)
+    NumInstances = TransMgr->getNumInstances();
+  TransMgr->resetRequestOptions();
+  return RV;
+}
+
+bool ClangDeltaSession::queryAllInstances(std::map<std::string, int> &Counts,
+                                          std::string &ErrorMsg)
+{
+  TransformationManager *TransMgr = TransformationManager::GetInstance();
+  TransMgr->resetRequestOptions();
+  return TransMgr->queryAllInstances(Counts, ErrorMsg);
+}
+
+bool ClangDeltaSession::transform(const std::string &Name,
+                                  int Counter, int ToCounter,
+                                  std::string &Result,
+                                  std::string &ErrorMsg, int &ErrorCode)
+{
+  TransformationManager *TransMgr = TransformationManager::GetInstance();
+  ErrorCode = -1;
+  TransMgr->resetRequestOptions();
+  if (TransMgr->setTransformation(Name)) {
+    ErrorMsg = "Invalid transformation[" + Name + "]";
+    return false;
+  }
+  if ((Counter <= 0) || (ToCounter < 0)) {
+    ErrorMsg = "Invalid transformation counter!";
+    ErrorCode = TransformationManager::ErrorInvalidCounter;
+    return false;
+  }
+  TransMgr->setTransformationCounter(Counter);
+  if (ToCounter > 0)
+    TransMgr->setToCounter(ToCounter);
+  TransMgr->setOutputBuffer(&Result);
+
+  bool RV = TransMgr->verify(ErrorMsg, ErrorCode) &&
+            TransMgr->runTransformation(ErrorMsg, ErrorCode);
+  TransMgr->resetRequestOptions();
+  return RV;
+}
+
+// The C interface
+
+struct clang_delta_session {
+  ClangDeltaSession *Session;
+};
+
+namespace {
+
+char *copyString(const std::string &Str)
+{
+  char *Copy = static_cast<char *>(malloc(Str.size() + 1));
+  if (Copy)
+    memcpy(Copy, Str.c_str(), Str.size() + 1);
+  return Copy;
+}
+
+void setError(char **Error, const std::string &ErrorMsg)
+{
+  if (Error)
+    *Error = copyString(ErrorMsg);
+}
+
+std::vector<std::string> &transformationNames()
+{
+  static std::vector<std::string> Names;
+  if (Names.empty())
+    ClangDeltaSession::getTransformationNames(Names);
+  return Names;
+}
+
+}
+
+clang_delta_session *clang_delta_session_create(const char *file_name,
+                                                const char *source,
+                                                size_t length,
+                                                char **error)
+{
+  std::string ErrorMsg;
+  ClangDeltaSession *Session =
+    ClangDeltaSession::create(file_name, std::string(source, length),
+                              ErrorMsg);
+  if (!Session) {
+    setError(error, ErrorMsg);
+    return NULL;
+  }
+  clang_delta_session *Handle = new clang_delta_session;
+  Handle->Session = Session;
+  return Handle;
+}
+
+void clang_delta_session_destroy(clang_delta_session *session)
+{
+  if (!session)
+    return;
+  delete session->Session;
+  delete session;
+}
+
+int clang_delta_set_source(clang_delta_session *session,
+                           const char *source, size_t length,
+                           char **error)
+{
+  std::string ErrorMsg;
+  if (!session->Session->setSource(std::string(source, length), ErrorMsg)) {
+    setError(error, ErrorMsg);
+    return CLANG_DELTA_ERROR;
+  }
+  return CLANG_DELTA_OK;
+}
+
+size_t clang_delta_num_transformations(void)
+{
+  return transformationNames().size();
+}
+
+const char *clang_delta_transformation_name(size_t index)
+{
+  std::vector<std::string> &Names = transformationNames();
+  if (index >= Names.size())
+    return NULL;
+  return Names[index].c_str();
+}
+
+int clang_delta_query_instances(clang_delta_session *session,
+                                const char *transformation,
+                                char **error)
+{
+  std::string ErrorMsg;
+  int NumInstances;
+  if (!session->Session->queryInstances(transformation, NumInstances,
+                                        ErrorMsg)) {
+    setError(error, ErrorMsg);
+    return -1;
+  }
+  return NumInstances;
+}
+
+int clang_delta_query_all_instances(clang_delta_session *session,
+                                    int *counts, char **error)
+{
+  std::string ErrorMsg;
+  std::map<std::string, int> Counts;
+  if (!session->Session->queryAllInstances(Counts, ErrorMsg)) {
+    setError(error, ErrorMsg);
+    return CLANG_DELTA_ERROR;
+  }
+  std::vector<std::string> &Names = transformationNames();
+  for (size_t I = 0; I < Names.size(); ++I) {
+    std::map<std::string, int>::iterator C = Counts.find(Names[I]);
+    counts[I] = (C == Counts.end()) ? 0 : (*C).second;
+  }
+  return CLANG_DELTA_OK;
+}
+
+int clang_delta_transform(clang_delta_session *session,
+                          const char *transformation,
+                          int counter, int to_counter,
+                          char **result, size_t *result_length,
+                          char **error)
+{
+  std::string Result;
+  std::string ErrorMsg;
+  int ErrorCode;
+  if (!session->Session->transform(transformation, counter, to_counter,
+                                   Result, ErrorMsg, ErrorCode)) {
+    setError(error, ErrorMsg);
+    if (ErrorCode == TransformationManager::ErrorInvalidCounter)
+      return CLANG_DELTA_ERROR_INVALID_COUNTER;
+    if (ErrorCode == TransformationManager::ErrorRangeConflict)
+      return CLANG_DELTA_ERROR_RANGE_CONFLICT;
+    return CLANG_DELTA_ERROR;
+  }
+  *result = copyString(Result);
+  if (!*result) {
+    setError(error, "Out of memory!");
+    return CLANG_DELTA_ERROR;
+  }
+  if (result_length)
+    *result_length = Result.size();
+  return CLANG_DELTA_OK;
+}
+
+void clang_delta_free(void *ptr)
+{
+  free(ptr);
+}
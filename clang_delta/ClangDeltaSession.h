@@ -0,0 +1,80 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (c) 2012, 2013, 2015, 2016 The University of Utah
+// All rights reserved.
+//
+// This file is distributed under the University of Illinois Open Source
+// License.  See the file COPYING for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CLANG_DELTA_SESSION_H
+#define CLANG_DELTA_SESSION_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+// The C++ interface of libclang_delta, for programs that run clang_delta
+// transformations in-process instead of starting a clang_delta for each
+// of them. A session parses a source held in memory once and runs any
+// number of queries and transformations against the AST; nothing is read
+// from or written to the disk, apart from the headers the source includes
+// and the AST cache, if CREDUCE_AST_CACHE is set.
+//
+// The transformations share global state (the TransformationManager), so
+// a process can have only one session at a time. A transformation that
+// crashes, or fails a TransAssert, fails the call that runs it rather
+// than ending the process.
+class ClangDeltaSession {
+
+public:
+
+  // Start a session on Contents. FileName is only used to pick the
+  // language, from its extension. Returns NULL, with a message in
+  // ErrorMsg, if the source cannot be parsed or another session exists.
+  static ClangDeltaSession *create(const std::string &FileName,
+                                   const std::string &Contents,
+                                   std::string &ErrorMsg);
+
+  ~ClangDeltaSession();
+
+  static void getTransformationNames(std::vector<std::string> &Names);
+
+  // Replace the source of the session, which is parsed again unless the
+  // contents are unchanged
+  bool setSource(const std::string &Contents, std::string &ErrorMsg);
+
+  bool queryInstances(const std::string &Name, int &NumInstances,
+                      std::string &ErrorMsg);
+
+  // Count the instances of every transformation, as
+  // clang_delta --query-all-instances does (-1 for those that crash)
+  bool queryAllInstances(std::map<std::string, int> &Counts,
+                         std::string &ErrorMsg);
+
+  // Perform instances [Counter, ToCounter] of transformation Name (only
+  // instance Counter if ToCounter is 0) and put the transformed source in
+  // Result. The source of the session is left as it is. On failure,
+  // ErrorCode is TransformationManager::ErrorInvalidCounter if the
+  // counters are out of range, ErrorRangeConflict if some instances of
+  // the range cannot be combined, and -1 otherwise.
+  bool transform(const std::string &Name, int Counter, int ToCounter,
+                 std::string &Result, std::string &ErrorMsg, int &ErrorCode);
+
+private:
+
+  explicit ClangDeltaSession(const std::string &FileName);
+
+  static ClangDeltaSession *Current;
+
+  std::string FileName;
+
+  // Unimplemented
+  ClangDeltaSession(const ClangDeltaSession &);
+
+  void operator=(const ClangDeltaSession &);
+
+};
+
+#endif
@@ -47,6 +47,11 @@ public:
 
   ~ExpressionDetector(void);
 
+  // The includes of stdio.h and stdlib.h are found by a PPCallbacks
+  virtual bool needsPreprocessor() {
+    return true;
+  }
+
 private:
   struct HeaderFunctionInfo {
     HeaderFunctionInfo () : HasHeader(false), HasFunction(false) { }
@@ -15,6 +15,7 @@
 #include "RewriteUtils.h"
 
 #include <cctype>
+#include <cstdlib>
 #include <sstream>
 #include "clang/Basic/SourceManager.h"
 #include "clang/Rewrite/Core/Rewriter.h"
@@ -24,9 +25,18 @@
 #include "clang/AST/Expr.h"
 #include "clang/AST/TypeLoc.h"
 #include "clang/AST/ExprCXX.h"
+#include "llvm/Support/CrashRecoveryContext.h"
 
 using namespace clang;
 
+void TransAssertFailed()
+{
+  if (llvm::CrashRecoveryContext *CRC =
+        llvm::CrashRecoveryContext::GetCurrent())
+    CRC->HandleCrash();
+  exit(-1);
+}
+
 static const char *DefaultIndentStr = "    ";
 
 RewriteUtils *RewriteUtils::Instance;
@@ -16,7 +16,7 @@
 #include "clang/AST/NestedNameSpecifier.h"
 
 #ifndef ENABLE_TRANS_ASSERT
-  #define TransAssert(x) {if (!(x)) exit(-1);}
+  #define TransAssert(x) {if (!(x)) TransAssertFailed();}
 #else
   #define TransAssert(x) assert(x)
 #endif
@@ -52,6 +52,10 @@ namespace clang {
   class ValueDecl;
 }
 
+// Exits, or, while TransformationManager runs transformations under crash
+// recovery, abandons the current one
+void TransAssertFailed();
+
 class RewriteUtils {
 public:
   static RewriteUtils *GetInstance(clang::Rewriter *RW);
@@ -14,6 +14,7 @@
 
 #include "Transformation.h"
 
+#include <algorithm>
 #include <sstream>
 
 #include "clang/AST/RecursiveASTVisitor.h"
@@ -103,6 +104,116 @@ void Transformation::outputTransformedSource(llvm::raw_ostream &OutStream)
   OutStream.flush();
 }
 
+namespace {
+
+// Where the byte at Offset of the original main file ended up in the
+// rewritten one: before any text inserted at Offset, or after it
+unsigned getRewrittenOffset(Rewriter &TheRewriter, SourceLocation FileStart,
+                            unsigned Offset, bool AfterInserts)
+{
+  Rewriter::RewriteOptions Opts;
+  Opts.IncludeInsertsAtBeginOfRange = true;
+  Opts.IncludeInsertsAtEndOfRange = AfterInserts;
+  return TheRewriter.getRangeSize(
+           CharSourceRange::getCharRange(FileStart,
+                                         FileStart.getLocWithOffset(Offset)),
+           Opts);
+}
+
+// Find the bytes in [Begin, End) of Old that the rewriter changed, by
+// bisecting until the parts left are either unchanged or single bytes.
+// A part is unchanged if it was moved, as it is, to the place the
+// rewriter maps it to, so this takes a few lookups per change rather
+// than one per byte.
+void collectChangedRanges(Rewriter &TheRewriter, SourceLocation FileStart,
+                          StringRef Old, StringRef New,
+                          unsigned Begin, unsigned End,
+                          std::vector<std::pair<unsigned, unsigned> > &Ranges)
+{
+  unsigned NewBegin =
+    getRewrittenOffset(TheRewriter, FileStart, Begin, false);
+  unsigned NewEnd = getRewrittenOffset(TheRewriter, FileStart, End, false);
+  if ((NewEnd - NewBegin == End - Begin) &&
+      (New.substr(NewBegin, End - Begin) == Old.substr(Begin, End - Begin)))
+    return;
+
+  if (End - Begin > 1) {
+    unsigned Mid = Begin + (End - Begin) / 2;
+    collectChangedRanges(TheRewriter, FileStart, Old, New, Begin, Mid, Ranges);
+    collectChangedRanges(TheRewriter, FileStart, Old, New, Mid, End, Ranges);
+    return;
+  }
+
+  // A single byte, either kept with text inserted in front of it, or
+  // replaced or removed (possibly along with an insertion)
+  unsigned Kept = getRewrittenOffset(TheRewriter, FileStart, Begin, true);
+  bool Inserted = (NewEnd - Kept == 1) && (New[Kept] == Old[Begin]);
+  unsigned RangeEnd = Inserted ? Begin : End;
+  if (!Ranges.empty() && (Ranges.back().second >= Begin))
+    Ranges.back().second = std::max(Ranges.back().second, RangeEnd);
+  else
+    Ranges.push_back(std::make_pair(Begin, RangeEnd));
+}
+
+}
+
+bool Transformation::getMainFileRanges(
+       std::vector<std::pair<unsigned, unsigned> > &Ranges, int &SizeDelta)
+{
+  FileID MainFileID = SrcManager->getMainFileID();
+  const RewriteBuffer *RWBuf = TheRewriter.getRewriteBufferFor(MainFileID);
+  if (!RWBuf)
+    return false;
+
+  StringRef Old = SrcManager->getBufferData(MainFileID);
+  std::string New(RWBuf->begin(), RWBuf->end());
+  SourceLocation FileStart = SrcManager->getLocForStartOfFile(MainFileID);
+  Ranges.clear();
+  if (!Old.empty())
+    collectChangedRanges(TheRewriter, FileStart, Old, New, 0, Old.size(),
+                         Ranges);
+
+  // text appended to the file
+  unsigned Size = Old.size();
+  if (getRewrittenOffset(TheRewriter, FileStart, Size, true) !=
+      getRewrittenOffset(TheRewriter, FileStart, Size, false)) {
+    if (Ranges.empty() || (Ranges.back().second < Size))
+      Ranges.push_back(std::make_pair(Size, Size));
+  }
+
+  SizeDelta = static_cast<int>(New.size()) - static_cast<int>(Old.size());
+  return !Ranges.empty();
+}
+
+// Text inserted at the start or the end of a range belongs to it: ranges
+// that touch have been merged, so no other range can claim it.
+bool Transformation::getMainFileEdits(std::vector<MainFileEdit> &Edits)
+{
+  std::vector<std::pair<unsigned, unsigned> > Ranges;
+  int SizeDelta;
+  Edits.clear();
+  if (!getMainFileRanges(Ranges, SizeDelta))
+    return false;
+
+  FileID MainFileID = SrcManager->getMainFileID();
+  const RewriteBuffer *RWBuf = TheRewriter.getRewriteBufferFor(MainFileID);
+  std::string New(RWBuf->begin(), RWBuf->end());
+  SourceLocation FileStart = SrcManager->getLocForStartOfFile(MainFileID);
+  for (std::vector<std::pair<unsigned, unsigned> >::iterator
+       I = Ranges.begin(), E = Ranges.end(); I != E; ++I) {
+    unsigned NewBegin =
+      getRewrittenOffset(TheRewriter, FileStart, (*I).first, false);
+    unsigned NewEnd =
+      getRewrittenOffset(TheRewriter, FileStart, (*I).second, true);
+    MainFileEdit Edit;
+    Edit.Offset = (*I).first;
+    Edit.Length = (*I).second - (*I).first;
+    Edit.Text = New.substr(NewBegin, NewEnd - NewBegin);
+    Edits.push_back(Edit);
+  }
+  return true;
+}
+
 void Transformation::outputOriginalSource(llvm::raw_ostream &OutStream)
 {
   FileID MainFileID = SrcManager->getMainFileID();
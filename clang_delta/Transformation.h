@@ -12,6 +12,8 @@
 #define TRANSFORMATION_H
 
 #include <string>
+#include <utility>
+#include <vector>
 #include <cstdlib>
 #include <cassert>
 #include "llvm/ADT/SmallPtrSet.h"
@@ -108,6 +110,27 @@ public:
 
   void outputTransformedSource(llvm::raw_ostream &OutStream);
 
+  // One change to the main file: the Length bytes at Offset of the
+  // original file are replaced by Text
+  struct MainFileEdit {
+    unsigned Offset;
+    unsigned Length;
+    std::string Text;
+  };
+
+  // The changes made to the main file, one per range found by
+  // getMainFileRanges(), in the same order. Returns false if the main
+  // file was not changed.
+  bool getMainFileEdits(std::vector<MainFileEdit> &Edits);
+
+  // The bytes of the main file changed by the transformation, as ranges
+  // [first, second) of offsets into the original file, in order and
+  // disjoint; text inserted without removing anything is an empty range
+  // at the place of the insertion. SizeDelta is the change in the size of
+  // the file. Returns false if the main file was not changed.
+  bool getMainFileRanges(std::vector<std::pair<unsigned, unsigned> > &Ranges,
+                         int &SizeDelta);
+
   void setTransformationCounter(int Counter) {
     TransformationCounter = Counter;
   }
@@ -165,6 +188,13 @@ public:
     return false;
   }
 
+  // Transformations that add PPCallbacks in Initialize have to see the
+  // source being preprocessed, so they cannot be run over an AST parsed
+  // beforehand; TransformationManager parses the source again for them.
+  virtual bool needsPreprocessor() {
+    return false;
+  }
+
   void Initialize(clang::ASTContext &context) override;
 
 protected:
@@ -14,23 +14,85 @@
 
 #include "TransformationManager.h"
 
+#include <algorithm>
 #include <sstream>
 
+#include "clang/AST/ASTConsumer.h"
+#include "clang/AST/ASTContext.h"
+#include "clang/Basic/Builtins.h"
 #include "clang/Basic/Diagnostic.h"
+#include "clang/Basic/FileManager.h"
 #include "clang/Basic/TargetInfo.h"
+#include "clang/Basic/Version.h"
 #include "clang/Lex/Preprocessor.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Parse/ParseAST.h"
+#include "clang/Serialization/ASTReader.h"
+#include "clang/Serialization/ASTWriter.h"
+#include "llvm/Bitcode/BitstreamWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/CrashRecoveryContext.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Timer.h"
 
 #include "Transformation.h"
 
 using namespace clang;
 
+int TransformationManager::ErrorInvalidCounter = 1;
+
+int TransformationManager::ErrorRangeConflict = 2;
+
 TransformationManager* TransformationManager::Instance;
 
 std::map<std::string, Transformation *> *
 TransformationManager::TransformationsMapPtr;
 
+std::map<std::string, std::pair<TransformationFactory, const char *> > *
+TransformationManager::TransformationFactoriesMapPtr;
+
+namespace {
+
+// Remembers the top-level declarations seen while parsing, so that they
+// can be handed to transformations that are run after the parse. If Next
+// is given, it sees the parse as well, without being owned.
+class TopLevelDeclRecorder : public ASTConsumer {
+public:
+  explicit TopLevelDeclRecorder(std::vector<DeclGroupRef> &Decls,
+                                ASTConsumer *Next = NULL)
+    : TopLevelDecls(Decls), Next(Next)
+  { }
+
+  void Initialize(ASTContext &Ctx) override {
+    if (Next)
+      Next->Initialize(Ctx);
+  }
+
+  // The whole source is parsed regardless of Next, as the other runs
+  // on the AST need all of it
+  bool HandleTopLevelDecl(DeclGroupRef D) override {
+    TopLevelDecls.push_back(D);
+    if (Next)
+      Next->HandleTopLevelDecl(D);
+    return true;
+  }
+
+  void HandleTranslationUnit(ASTContext &Ctx) override {
+    if (Next)
+      Next->HandleTranslationUnit(Ctx);
+  }
+
+private:
+  std::vector<DeclGroupRef> &TopLevelDecls;
+
+  ASTConsumer *Next;
+};
+
+}
+
 TransformationManager *TransformationManager::GetInstance()
 {
   if (TransformationManager::Instance)
@@ -39,8 +101,24 @@ TransformationManager *TransformationManager::GetInstance()
   TransformationManager::Instance = new TransformationManager();
   assert(TransformationManager::Instance);
 
-  TransformationManager::Instance->TransformationsMap =
-    *TransformationManager::TransformationsMapPtr;
+  if (TransformationManager::TransformationsMapPtr)
+    TransformationManager::Instance->TransformationsMap =
+      *TransformationManager::TransformationsMapPtr;
+
+  if (TransformationManager::TransformationFactoriesMapPtr) {
+    std::map<std::string,
+             std::pair<TransformationFactory, const char *> >::iterator I, E;
+    for (I = TransformationFactoriesMapPtr->begin(),
+         E = TransformationFactoriesMapPtr->end();
+         I != E; ++I) {
+      std::map<std::string, Transformation *> &TransMap =
+        TransformationManager::Instance->TransformationsMap;
+      if (TransMap.find((*I).first) != TransMap.end())
+        continue;
+      TransMap[(*I).first] =
+        (*I).second.first((*I).first.c_str(), (*I).second.second);
+    }
+  }
   return TransformationManager::Instance;
 }
 
@@ -53,11 +131,14 @@ void TransformationManager::Finalize()
        E = Instance->TransformationsMap.end();
        I != E; ++I) {
     // CurrentTransformationImpl will be freed by ClangInstance
-    if ((*I).second != Instance->CurrentTransformationImpl)
+    if (!Instance->CurrentTransformationOwnedByClang ||
+        ((*I).second != Instance->CurrentTransformationImpl))
       delete (*I).second;
   }
   if (Instance->TransformationsMapPtr)
     delete Instance->TransformationsMapPtr;
+  if (Instance->TransformationFactoriesMapPtr)
+    delete Instance->TransformationFactoriesMapPtr;
 
   delete Instance->ClangInstance;
 
@@ -67,6 +148,10 @@ void TransformationManager::Finalize()
 
 llvm::raw_ostream *TransformationManager::getOutStream()
 {
+  if (OutputBuffer) {
+    OutputBuffer->clear();
+    return new llvm::raw_string_ostream(*OutputBuffer);
+  }
   if (OutputFileName.empty())
     return &(llvm::outs());
 
@@ -79,7 +164,7 @@ llvm::raw_ostream *TransformationManager::getOutStream()
 
 void TransformationManager::closeOutStream(llvm::raw_ostream *OutStream)
 {
-  if (!OutputFileName.empty())
+  if (OutputBuffer || !OutputFileName.empty())
     delete OutStream;
 }
 
@@ -99,6 +184,38 @@ void TransformationManager::registerTransformation(
   (*TransformationManager::TransformationsMapPtr)[TransName] = TransImpl;
 }
 
+void TransformationManager::registerTransformationFactory(
+       const char *TransName,
+       const char *Desc,
+       TransformationFactory Factory)
+{
+  if (!TransformationManager::TransformationFactoriesMapPtr) {
+    TransformationManager::TransformationFactoriesMapPtr =
+      new std::map<std::string,
+                   std::pair<TransformationFactory, const char *> >();
+  }
+
+  assert((Factory != NULL) && "NULL TransformationFactory!");
+  assert((TransformationFactoriesMapPtr->find(TransName) ==
+          TransformationFactoriesMapPtr->end()) &&
+         "Duplicated transformation!");
+  (*TransformationFactoriesMapPtr)[TransName] =
+    std::make_pair(Factory, Desc);
+}
+
+Transformation *
+TransformationManager::createTransformation(const std::string &Trans)
+{
+  if (!TransformationFactoriesMapPtr)
+    return NULL;
+  std::map<std::string,
+           std::pair<TransformationFactory, const char *> >::iterator I =
+    TransformationFactoriesMapPtr->find(Trans);
+  if (I == TransformationFactoriesMapPtr->end())
+    return NULL;
+  return (*I).second.first((*I).first.c_str(), (*I).second.second);
+}
+
 void TransformationManager::printTransformations()
 {
   llvm::outs() << "Registered Transformations:\n";
@@ -122,29 +239,53 @@ void TransformationManager::printTransformationNames()
   }
 }
 
+void TransformationManager::getTransformationNames(
+       std::vector<std::string> &Names)
+{
+  std::map<std::string, Transformation *>::iterator I, E;
+  for (I = TransformationsMap.begin(),
+       E = TransformationsMap.end();
+       I != E; ++I) {
+    Names.push_back((*I).first);
+  }
+}
+
 void TransformationManager::outputNumTransformationInstances()
 {
-  int NumInstances =
-    CurrentTransformationImpl->getNumTransformationInstances();
   llvm::outs() << "Available transformation instances: "
                << NumInstances << "\n";
 }
 
 TransformationManager::TransformationManager()
   : CurrentTransformationImpl(NULL),
+    CurrentTransformationOwnedByClang(false),
     TransformationCounter(-1),
     ToCounter(-1),
     SrcFileName(""),
+    SrcContents(""),
+    SrcInMemory(false),
     OutputFileName(""),
+    OutputBuffer(NULL),
     CurrentTransName(""),
     ClangInstance(NULL),
     QueryInstanceOnly(false),
     DoReplacement(false),
     Replacement(""),
     CheckReference(false),
-    ReferenceValue("")
+    ReferenceValue(""),
+    CrashRecovery(false),
+    SourceHash(""),
+    NumParses(0),
+    NumRuns(0),
+    NumInstances(0),
+    ASTCacheDir(""),
+    NumCacheHits(0),
+    NumCacheMisses(0),
+    LoadTime(0),
+    ParseTime(0)
 {
-  // Nothing to do
+  if (const char *env = getenv("CREDUCE_AST_CACHE"))
+    ASTCacheDir = env;
 }
 
 TransformationManager::~TransformationManager()
@@ -153,7 +294,8 @@ TransformationManager::~TransformationManager()
 }
 
 // Transform changes start
-// Just to avoid linking errors.
+// When the transformations are embedded without a compiler instance
+// managed by TransformationManager, fall back to permissive answers.
 Preprocessor &TransformationManager::getPreprocessor()
 {
   return GetInstance()->ClangInstance->getPreprocessor();
@@ -161,36 +303,956 @@ Preprocessor &TransformationManager::getPreprocessor()
 
 bool TransformationManager::isCXXLangOpt()
 {
-  return true;
+  if (!Instance || !Instance->ClangInstance)
+    return true;
+  return (Instance->ClangInstance->getLangOpts().CPlusPlus);
 }
 
 bool TransformationManager::isCLangOpt()
 {
-  return true;
+  if (!Instance || !Instance->ClangInstance)
+    return true;
+  return (Instance->ClangInstance->getLangOpts().C99);
 }
 
 bool TransformationManager::isOpenCLLangOpt()
 {
+  if (!Instance || !Instance->ClangInstance)
+    return true;
+  return (Instance->ClangInstance->getLangOpts().OpenCL);
+}
+// Transform changes end
+
+bool TransformationManager::createCompilerInstance(
+       std::unique_ptr<ASTConsumer> Consumer, std::string &ErrorMsg,
+       bool OpenMainFile)
+{
+  if (ClangInstance) {
+    ErrorMsg = "CompilerInstance has been initialized!";
+    return false;
+  }
+
+  ClangInstance = new CompilerInstance();
+  assert(ClangInstance);
+
+  ClangInstance->createDiagnostics();
+
+  TargetOptions &TargetOpts = ClangInstance->getTargetOpts();
+  PreprocessorOptions &PPOpts = ClangInstance->getPreprocessorOpts();
+  if (const char *env = getenv("CREDUCE_TARGET_TRIPLE")) {
+    TargetOpts.Triple = std::string(env);
+  } else {
+    TargetOpts.Triple = LLVM_DEFAULT_TARGET_TRIPLE;
+  }
+  llvm::Triple T(TargetOpts.Triple);
+  CompilerInvocation &Invocation = ClangInstance->getInvocation();
+  InputKind IK = FrontendOptions::getInputKindForExtension(
+        StringRef(SrcFileName).rsplit('.').second);
+  if (IK.getLanguage() == InputKind::C) {
+    Invocation.setLangDefaults(ClangInstance->getLangOpts(), InputKind::C,
+                               T, PPOpts);
+  }
+  else if (IK.getLanguage() == InputKind::CXX) {
+    // ISSUE: it might cause some problems when building AST
+    // for a function which has a non-declared callee, e.g.,
+    // It results an empty AST for the caller.
+    Invocation.setLangDefaults(ClangInstance->getLangOpts(), InputKind::CXX,
+                               T, PPOpts);
+  }
+  else if (IK.getLanguage() == InputKind::OpenCL) {
+    // Commandline parameters
+    std::vector<const char*> Args;
+    Args.push_back("-x");
+    Args.push_back("cl");
+    Args.push_back("-Dcl_clang_storage_class_specifiers");
+
+    const char *CLCPath = getenv("CREDUCE_LIBCLC_INCLUDE_PATH");
+
+    ClangInstance->createFileManager();
+
+    if (CLCPath != NULL && ClangInstance->hasFileManager() &&
+        ClangInstance->getFileManager().getDirectory(CLCPath, false)) {
+      Args.push_back("-I");
+      Args.push_back(CLCPath);
+    }
+
+    Args.push_back("-include");
+    Args.push_back("clc/clc.h");
+    Args.push_back("-fno-builtin");
+
+    CompilerInvocation::CreateFromArgs(Invocation,
+                                       &Args[0], &Args[0] + Args.size(),
+                                       ClangInstance->getDiagnostics());
+    Invocation.setLangDefaults(ClangInstance->getLangOpts(),
+                               InputKind::OpenCL, T, PPOpts);
+  }
+  else {
+    ErrorMsg = "Unsupported file type!";
+    return false;
+  }
+
+  TargetInfo *Target =
+    TargetInfo::CreateTargetInfo(ClangInstance->getDiagnostics(),
+                                 ClangInstance->getInvocation().TargetOpts);
+  ClangInstance->setTarget(Target);
+
+  if (const char *env = getenv("CREDUCE_INCLUDE_PATH")) {
+    HeaderSearchOptions &HeaderSearchOpts =
+      ClangInstance->getHeaderSearchOpts();
+
+    const std::size_t npos = std::string::npos;
+    std::string text = env;
+
+    std::size_t now = 0, next = 0;
+    do {
+      next = text.find(':', now);
+      std::size_t len = (next == npos) ? npos : (next - now);
+      HeaderSearchOpts.AddPath(text.substr(now, len),
+                               clang::frontend::Angled, false, false);
+      now = next + 1;
+    } while (next != npos);
+  }
+
+  if (OpenMainFile && SrcInMemory) {
+    ClangInstance->getPreprocessorOpts().addRemappedFile(SrcFileName,
+      llvm::MemoryBuffer::getMemBufferCopy(SrcContents, SrcFileName).release());
+  }
+
+  ClangInstance->createFileManager();
+  ClangInstance->createSourceManager(ClangInstance->getFileManager());
+  ClangInstance->createPreprocessor(TU_Complete);
+
+  DiagnosticConsumer &DgClient = ClangInstance->getDiagnosticClient();
+  DgClient.BeginSourceFile(ClangInstance->getLangOpts(),
+                           &ClangInstance->getPreprocessor());
+  ClangInstance->createASTContext();
+
+  ClangInstance->setASTConsumer(std::move(Consumer));
+  Preprocessor &PP = ClangInstance->getPreprocessor();
+  PP.getBuiltinInfo().initializeBuiltins(PP.getIdentifierTable(),
+                                         PP.getLangOpts());
+
+  // A cached AST brings its own main file along
+  if (OpenMainFile && !ClangInstance->InitializeSourceManager(
+         FrontendInputFile(SrcFileName, IK))) {
+    ErrorMsg = "Cannot open source file!";
+    return false;
+  }
+
   return true;
 }
 
+void TransformationManager::configureTransformation(Transformation *TransImpl)
+{
+  // These two need to be set before Transformation::Initialize.
+  if (DoReplacement)
+    TransImpl->setReplacement(Replacement);
+  if (CheckReference)
+    TransImpl->setReferenceValue(ReferenceValue);
+}
+
 bool TransformationManager::initializeCompilerInstance(std::string &ErrorMsg)
+{
+  assert(CurrentTransformationImpl && "Bad transformation instance!");
+  configureTransformation(CurrentTransformationImpl);
+  CurrentTransformationOwnedByClang = true;
+  return createCompilerInstance(
+           std::unique_ptr<ASTConsumer>(CurrentTransformationImpl), ErrorMsg);
+}
+
+bool TransformationManager::outputTransformation(Transformation *TransImpl,
+                                                 std::string &ErrorMsg,
+                                                 int &ErrorCode)
+{
+  if (QueryInstanceOnly)
+    return true;
+
+  llvm::raw_ostream *OutStream = getOutStream();
+  bool RV;
+  if (TransImpl->transSuccess()) {
+    TransImpl->outputTransformedSource(*OutStream);
+    RV = true;
+  }
+  else if (TransImpl->transInternalError()) {
+    TransImpl->outputOriginalSource(*OutStream);
+    RV = true;
+  }
+  else {
+    TransImpl->getTransErrorMsg(ErrorMsg);
+    if (TransImpl->isInvalidCounterError())
+      ErrorCode = ErrorInvalidCounter;
+    RV = false;
+  }
+  closeOutStream(OutStream);
+  return RV;
+}
+
+bool TransformationManager::doTransformation(std::string &ErrorMsg,
+                                             int &ErrorCode)
 {
   ErrorMsg = "";
+
+  ClangInstance->createSema(TU_Complete, 0);
+  DiagnosticsEngine &Diag = ClangInstance->getDiagnostics();
+  Diag.setSuppressAllDiagnostics(true);
+  Diag.setIgnoreAllWarnings(true);
+
+  CurrentTransformationImpl->setQueryInstanceFlag(QueryInstanceOnly);
+  CurrentTransformationImpl->setTransformationCounter(TransformationCounter);
+  if (ToCounter > 0) {
+    if (CurrentTransformationImpl->isMultipleRewritesEnabled()) {
+      CurrentTransformationImpl->setToCounter(ToCounter);
+    }
+    else {
+      ErrorMsg = "current transformation[";
+      ErrorMsg += CurrentTransName;
+      ErrorMsg += "] does not support multiple rewrites!";
+      return false;
+    }
+  }
+
+  ParseAST(ClangInstance->getSema());
+
+  ClangInstance->getDiagnosticClient().EndSourceFile();
+
+  NumInstances = CurrentTransformationImpl->getNumTransformationInstances();
+  return outputTransformation(CurrentTransformationImpl, ErrorMsg, ErrorCode);
+}
+
+bool TransformationManager::verify(std::string &ErrorMsg, int &ErrorCode)
+{
+  if (!CurrentTransformationImpl) {
+    ErrorMsg = "Empty transformation instance!";
+    return false;
+  }
+
+  if (CurrentTransformationImpl->skipCounter())
+    return true;
+
+  if (TransformationCounter <= 0) {
+    ErrorMsg = "Invalid transformation counter!";
+    ErrorCode = ErrorInvalidCounter;
+    return false;
+  }
+
+  if ((ToCounter > 0) && (ToCounter < TransformationCounter)) {
+    ErrorMsg = "to-counter value cannot be smaller than counter value!";
+    ErrorCode = ErrorInvalidCounter;
+    return false;
+  }
+
   return true;
 }
 
-bool TransformationManager::doTransformation(std::string &ErrorMsg, int &ErrorCode)
+void TransformationManager::resetRequestOptions()
 {
-  ErrorMsg = "";
-  ErrorCode = 0;
+  CurrentTransformationImpl = NULL;
+  CurrentTransName = "";
+  TransformationCounter = -1;
+  ToCounter = -1;
+  OutputFileName = "";
+  OutputBuffer = NULL;
+  QueryInstanceOnly = false;
+  DoReplacement = false;
+  Replacement = "";
+  CheckReference = false;
+  ReferenceValue = "";
+}
+
+void TransformationManager::resetSource()
+{
+  TopLevelDecls.clear();
+  delete ClangInstance;
+  ClangInstance = NULL;
+  SrcFileName = "";
+  SrcContents = "";
+  SrcInMemory = false;
+  SourceHash = "";
+}
+
+bool TransformationManager::loadSource(const std::string &FileName,
+                                       std::string &ErrorMsg)
+{
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer> > Buf =
+    llvm::MemoryBuffer::getFile(FileName);
+  if (!Buf) {
+    ErrorMsg = "Cannot open source file!";
+    return false;
+  }
+  return loadSourceContents(FileName, (*Buf)->getBuffer(), false, ErrorMsg);
+}
+
+bool TransformationManager::loadSourceBuffer(const std::string &FileName,
+                                             const std::string &Contents,
+                                             std::string &ErrorMsg)
+{
+  return loadSourceContents(FileName, Contents, true, ErrorMsg);
+}
+
+// Set up the source to be parsed next. A source held in memory is handed
+// to the compiler instance as a remapped file, so nothing is read from
+// (or needs to exist on) the disk. The contents are kept in any case, for
+// parsing the source again in runOnSource().
+void TransformationManager::setSource(const std::string &FileName,
+                                      StringRef Contents, bool InMemory)
+{
+  SrcFileName = FileName;
+  SrcInMemory = InMemory;
+  SrcContents = Contents.str();
+}
+
+// Parse the source set up by setSource(), recording its top-level
+// declarations in TopLevelDecls and showing the parse to Next, if given.
+bool TransformationManager::parseSource(Transformation *Next,
+                                        std::string &ErrorMsg)
+{
+  double Start = llvm::TimeRecord::getCurrentTime(true).getWallTime();
+  if (!createCompilerInstance(std::unique_ptr<ASTConsumer>(
+                                new TopLevelDeclRecorder(TopLevelDecls, Next)),
+                              ErrorMsg))
+    return false;
+
+  ClangInstance->createSema(TU_Complete, 0);
+  DiagnosticsEngine &Diag = ClangInstance->getDiagnostics();
+  Diag.setSuppressAllDiagnostics(true);
+  Diag.setIgnoreAllWarnings(true);
+
+  ParseAST(ClangInstance->getSema());
+
+  ClangInstance->getDiagnosticClient().EndSourceFile();
+
+  ParseTime += llvm::TimeRecord::getCurrentTime(true).getWallTime() - Start;
+  NumParses++;
   return true;
 }
 
-bool TransformationManager::verify(std::string &ErrorMsg, int &ErrorCode)
+bool TransformationManager::loadSourceContents(const std::string &FileName,
+                                               StringRef Contents,
+                                               bool InMemory,
+                                               std::string &ErrorMsg)
+{
+  llvm::MD5 Hasher;
+  llvm::MD5::MD5Result Result;
+  Hasher.update(Contents);
+  Hasher.final(Result);
+  llvm::SmallString<32> Hash;
+  llvm::MD5::stringifyResult(Result, Hash);
+
+  // The language is derived from the file name, so a renamed file with
+  // the same contents still needs a new parse.
+  if (ClangInstance && (Hash.str() == SourceHash) &&
+      (StringRef(FileName).rsplit('.').second ==
+       StringRef(SrcFileName).rsplit('.').second))
+    return true;
+
+  resetSource();
+  setSource(FileName, Contents, InMemory);
+
+  std::string CacheKey;
+  if (usesASTCache()) {
+    CacheKey = getASTCacheKey(Contents);
+    double Start = llvm::TimeRecord::getCurrentTime(true).getWallTime();
+    if (loadCachedAST(CacheKey)) {
+      double Time =
+        llvm::TimeRecord::getCurrentTime(true).getWallTime() - Start;
+      LoadTime += Time;
+      NumCacheHits++;
+      std::stringstream Event;
+      Event << "hit " << Time;
+      logCacheEvent(Event.str());
+      SourceHash = Hash.str();
+      return true;
+    }
+    resetSource();
+    setSource(FileName, Contents, InMemory);
+  }
+
+  double ParseTimeBefore = ParseTime;
+  if (!parseSource(NULL, ErrorMsg)) {
+    resetSource();
+    return false;
+  }
+  double Time = ParseTime - ParseTimeBefore;
+  SourceHash = Hash.str();
+
+  if (!CacheKey.empty()) {
+    NumCacheMisses++;
+    std::stringstream Event;
+    Event << (saveCachedAST(CacheKey) ? "miss " : "uncached ") << Time;
+    logCacheEvent(Event.str());
+  }
+  return true;
+}
+
+// The key of a source in the AST cache covers everything its AST depends
+// on: the contents, the language (from the extension), the options taken
+// from the environment, and the version of Clang.
+std::string TransformationManager::getASTCacheKey(StringRef Contents)
+{
+  const char *Env[] = { "CREDUCE_TARGET_TRIPLE", "CREDUCE_INCLUDE_PATH",
+                        "CREDUCE_LIBCLC_INCLUDE_PATH" };
+  llvm::MD5 Hasher;
+  Hasher.update(Contents);
+  Hasher.update(StringRef("\0", 1));
+  Hasher.update(StringRef(SrcFileName).rsplit('.').second);
+  for (unsigned I = 0; I < sizeof(Env) / sizeof(Env[0]); ++I) {
+    const char *Value = getenv(Env[I]);
+    Hasher.update(StringRef("\0", 1));
+    Hasher.update(Value ? StringRef(Value) : StringRef("-"));
+  }
+  Hasher.update(StringRef("\0", 1));
+  Hasher.update(getClangFullVersion());
+
+  llvm::MD5::MD5Result Result;
+  Hasher.final(Result);
+  llvm::SmallString<32> Key;
+  llvm::MD5::stringifyResult(Result, Key);
+  return Key.str();
+}
+
+namespace {
+
+std::string cachePath(const std::string &Dir, const std::string &Key,
+                      const char *Suffix)
+{
+  llvm::SmallString<128> Path(Dir);
+  llvm::sys::path::append(Path, Key + Suffix);
+  return Path.str();
+}
+
+// Write a file of the cache under a temporary name and rename it into
+// place, so that other processes never see it half written.
+bool writeCacheFile(const std::string &Path, StringRef Data)
+{
+  int FD;
+  llvm::SmallString<128> TmpPath;
+  if (llvm::sys::fs::createUniqueFile(Path + "-%%%%%%", FD, TmpPath))
+    return false;
+  {
+    llvm::raw_fd_ostream Out(FD, /*shouldClose=*/true);
+    Out << Data;
+    Out.close();
+    if (Out.has_error()) {
+      Out.clear_error();
+      llvm::sys::fs::remove(TmpPath);
+      return false;
+    }
+  }
+  if (llvm::sys::fs::rename(TmpPath, Path)) {
+    llvm::sys::fs::remove(TmpPath);
+    return false;
+  }
+  return true;
+}
+
+}
+
+// Serialize the AST just built by loadSource() into the cache, along with
+// the way its top-level declarations were grouped when they were handed
+// to the consumer: the declarations of a cached AST are found again in
+// the translation unit, where they are no longer grouped. Each line of
+// the .decls file is one group, as pairs of the position of a declaration
+// in the translation unit and its kind.
+bool TransformationManager::saveCachedAST(const std::string &Key)
+{
+  // Transformations look at the errors recorded while parsing, which are
+  // not serialized, so only sources that parse cleanly are cached.
+  if (ClangInstance->getDiagnostics().hasErrorOccurred())
+    return false;
+
+  std::map<Decl *, unsigned> Positions;
+  TranslationUnitDecl *TU =
+    ClangInstance->getASTContext().getTranslationUnitDecl();
+  for (DeclContext::decl_iterator I = TU->decls_begin(),
+       E = TU->decls_end(); I != E; ++I) {
+    Positions.insert(std::make_pair(*I, Positions.size()));
+  }
+
+  std::stringstream Layout;
+  Layout << Positions.size() << "\n";
+  for (std::vector<DeclGroupRef>::iterator I = TopLevelDecls.begin(),
+       E = TopLevelDecls.end(); I != E; ++I) {
+    for (DeclGroupRef::iterator DI = (*I).begin(), DE = (*I).end();
+         DI != DE; ++DI) {
+      std::map<Decl *, unsigned>::iterator P = Positions.find(*DI);
+      if (P == Positions.end())
+        return false;
+      if (DI != (*I).begin())
+        Layout << " ";
+      Layout << (*P).second << " " << (*DI)->getKind();
+    }
+    Layout << "\n";
+  }
+
+  // Embed the contents of the main file in the AST file, so that loading
+  // it does not depend on the file it was parsed from, which is usually
+  // gone (or holds something else) by the time the cache entry is used.
+  SourceManager &SrcManager = ClangInstance->getSourceManager();
+  SrcManager.setFileIsTransient(
+    SrcManager.getFileEntryForID(SrcManager.getMainFileID()));
+
+  llvm::SmallString<128> Buffer;
+  {
+    llvm::BitstreamWriter Stream(Buffer);
+    ASTWriter Writer(Stream, Buffer, ClangInstance->getPCMCache(),
+                     ArrayRef<std::shared_ptr<ModuleFileExtension> >());
+    Writer.WriteAST(ClangInstance->getSema(), std::string(), NULL, "");
+  }
+  if (Buffer.empty())
+    return false;
+
+  // the AST file goes last; an entry only counts once it exists
+  llvm::sys::fs::create_directories(ASTCacheDir);
+  return writeCacheFile(cachePath(ASTCacheDir, Key, ".decls"),
+                        Layout.str()) &&
+         writeCacheFile(cachePath(ASTCacheDir, Key, ".ast"), Buffer.str());
+}
+
+// Load the AST of a source from the cache, in place of parsing it.
+bool TransformationManager::loadCachedAST(const std::string &Key)
+{
+  std::string ASTPath = cachePath(ASTCacheDir, Key, ".ast");
+  if (!llvm::sys::fs::exists(ASTPath))
+    return false;
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer> > LayoutBuf =
+    llvm::MemoryBuffer::getFile(cachePath(ASTCacheDir, Key, ".decls"));
+  if (!LayoutBuf)
+    return false;
+
+  std::string ErrorMsg;
+  if (!createCompilerInstance(std::unique_ptr<ASTConsumer>(new ASTConsumer()),
+                              ErrorMsg, /*OpenMainFile=*/false))
+    return false;
+
+  Preprocessor &PP = ClangInstance->getPreprocessor();
+  ASTContext &Ctx = ClangInstance->getASTContext();
+  DiagnosticsEngine &Diag = ClangInstance->getDiagnostics();
+  Diag.setSuppressAllDiagnostics(true);
+  Diag.setIgnoreAllWarnings(true);
+
+  // The reader checks that the AST was built with the same language and
+  // target options, and that the headers it includes have not changed.
+  IntrusiveRefCntPtr<ASTReader> Reader(
+    new ASTReader(PP, Ctx, ClangInstance->getPCHContainerReader(),
+                  ArrayRef<std::shared_ptr<ModuleFileExtension> >()));
+  // declarations may be deserialized while the AST is being read
+  Ctx.setExternalSource(Reader);
+  if (Reader->ReadAST(ASTPath, serialization::MK_MainFile, SourceLocation(),
+                      ASTReader::ARR_None) != ASTReader::Success)
+    return false;
+  ClangInstance->getDiagnosticClient().EndSourceFile();
+  if (ClangInstance->getSourceManager().getMainFileID().isInvalid())
+    return false;
+
+  std::vector<Decl *> Decls;
+  TranslationUnitDecl *TU = Ctx.getTranslationUnitDecl();
+  for (DeclContext::decl_iterator I = TU->decls_begin(),
+       E = TU->decls_end(); I != E; ++I) {
+    Decls.push_back(*I);
+  }
+
+  std::stringstream Layout((*LayoutBuf)->getBuffer().str());
+  std::string Line;
+  unsigned NumDecls;
+  if (!std::getline(Layout, Line) ||
+      !(std::stringstream(Line) >> NumDecls) || (NumDecls > Decls.size()))
+    return false;
+  while (std::getline(Layout, Line)) {
+    std::stringstream LineSS(Line);
+    SmallVector<Decl *, 4> Group;
+    unsigned Pos, Kind;
+    while (LineSS >> Pos >> Kind) {
+      if ((Pos >= NumDecls) ||
+          (static_cast<unsigned>(Decls[Pos]->getKind()) != Kind))
+        return false;
+      Group.push_back(Decls[Pos]);
+    }
+    if (Group.empty())
+      return false;
+    if (Group.size() == 1)
+      TopLevelDecls.push_back(DeclGroupRef(Group[0]));
+    else
+      TopLevelDecls.push_back(
+        DeclGroupRef::Create(Ctx, Group.data(), Group.size()));
+  }
+  return true;
+}
+
+// Append one line per source loaded to the cache's log, which a driver
+// running many clang_delta processes can sum up.
+void TransformationManager::logCacheEvent(const std::string &Event)
+{
+  llvm::sys::fs::create_directories(ASTCacheDir);
+  std::error_code EC;
+  llvm::raw_fd_ostream Out(cachePath(ASTCacheDir, "stats", ""), EC,
+                           llvm::sys::fs::F_Append);
+  if (EC)
+    return;
+  Out << Event << "\n";
+}
+
+bool TransformationManager::needsSession()
+{
+  return (ToCounter > 0) && !QueryInstanceOnly && CurrentTransformationImpl &&
+         !CurrentTransformationImpl->isMultipleRewritesEnabled();
+}
+
+// Replace the AST of the loaded source with a new parse of it, which Next
+// sees, if given.
+bool TransformationManager::reparseSource(Transformation *Next,
+                                          std::string &ErrorMsg)
+{
+  TopLevelDecls.clear();
+  delete ClangInstance;
+  ClangInstance = NULL;
+  // the file may have changed on the disk since it was loaded
+  SrcInMemory = true;
+  if (!parseSource(Next, ErrorMsg)) {
+    resetSource();
+    return false;
+  }
+  return true;
+}
+
+// Run TransImpl over the AST built by loadSource(). A transformation that
+// needs the preprocessor instead gets a fresh parse of the source, whose
+// AST then replaces the old one; the PPCallbacks it added stay behind
+// with that parse's preprocessor, which nothing runs again. Returns false
+// only if the parse fails, which leaves no source loaded.
+bool TransformationManager::runOnSource(Transformation *TransImpl,
+                                        std::string &ErrorMsg)
+{
+  if (TransImpl->needsPreprocessor()) {
+    if (!reparseSource(TransImpl, ErrorMsg))
+      return false;
+    NumRuns++;
+    return true;
+  }
+
+  // Some transformations turn diagnostics back on and then look at the
+  // errors recorded while parsing; those are kept as they are, but the
+  // suppression flags have to be restored for the next run.
+  ASTContext &Ctx = ClangInstance->getASTContext();
+  DiagnosticsEngine &Diag = ClangInstance->getDiagnostics();
+  Diag.setSuppressAllDiagnostics(true);
+  Diag.setIgnoreAllWarnings(true);
+
+  ASTConsumer *Consumer = TransImpl;
+  Consumer->Initialize(Ctx);
+  for (std::vector<DeclGroupRef>::iterator I = TopLevelDecls.begin(),
+       E = TopLevelDecls.end(); I != E; ++I) {
+    Consumer->HandleTopLevelDecl(*I);
+  }
+  Consumer->HandleTranslationUnit(Ctx);
+  NumRuns++;
+  return true;
+}
+
+bool TransformationManager::runTransformation(std::string &ErrorMsg,
+                                              int &ErrorCode)
 {
   ErrorMsg = "";
-  ErrorCode = 0;
+
+  if (!ClangInstance || SourceHash.empty()) {
+    ErrorMsg = "No source has been loaded!";
+    return false;
+  }
+
+  Transformation *TransImpl = createTransformation(CurrentTransName);
+  if (!TransImpl) {
+    ErrorMsg = "transformation[";
+    ErrorMsg += CurrentTransName;
+    ErrorMsg += "] cannot be instantiated!";
+    return false;
+  }
+
+  if ((ToCounter > 0) && !TransImpl->isMultipleRewritesEnabled() &&
+      !QueryInstanceOnly) {
+    delete TransImpl;
+    return runTransformationRange(ErrorMsg, ErrorCode);
+  }
+
+  configureTransformation(TransImpl);
+  TransImpl->setQueryInstanceFlag(QueryInstanceOnly);
+  TransImpl->setTransformationCounter(TransformationCounter);
+  if (ToCounter > 0)
+    TransImpl->setToCounter(ToCounter);
+
+  if (!runRequestOnSource(TransImpl, ErrorMsg))
+    return false;
+
+  bool RV = outputTransformation(TransImpl, ErrorMsg, ErrorCode);
+  NumInstances = TransImpl->getNumTransformationInstances();
+  delete TransImpl;
+  return RV;
+}
+
+namespace {
+
+struct SafeRun {
+  Transformation *TransImpl;
+  std::string ErrorMsg;
+  bool Ok;
+};
+
+}
+
+void TransformationManager::runOnSourceCallback(void *Data)
+{
+  SafeRun *Run = static_cast<SafeRun *>(Data);
+  Run->Ok = Instance->runOnSource(Run->TransImpl, Run->ErrorMsg);
+}
+
+// Like runOnSource(), but set Crashed instead of ending the process if
+// the transformation crashes or fails a TransAssert. Crash recovery has
+// to be enabled.
+bool TransformationManager::runOnSourceSafely(Transformation *TransImpl,
+                                              bool &Crashed,
+                                              std::string &ErrorMsg)
+{
+  SafeRun Run;
+  Run.TransImpl = TransImpl;
+  Run.Ok = false;
+  llvm::CrashRecoveryContext CRC;
+  Crashed = !CRC.RunSafely(runOnSourceCallback, &Run);
+  ErrorMsg = Run.ErrorMsg;
+  return Crashed || Run.Ok;
+}
+
+// Run TransImpl for a request: with runOnSourceSafely() if crash recovery
+// is on, so that a crash only fails the request, and with runOnSource()
+// otherwise. On failure TransImpl is gone: deleted, or leaked after a
+// crash, which leaves it half-way through its run.
+bool TransformationManager::runRequestOnSource(Transformation *TransImpl,
+                                               std::string &ErrorMsg)
+{
+  if (!CrashRecovery) {
+    if (runOnSource(TransImpl, ErrorMsg))
+      return true;
+    delete TransImpl;
+    return false;
+  }
+
+  bool Crashed;
+  llvm::CrashRecoveryContext::Enable();
+  bool RV = runOnSourceSafely(TransImpl, Crashed, ErrorMsg);
+  llvm::CrashRecoveryContext::Disable();
+  if (RV && !Crashed)
+    return true;
+  if (!Crashed) {
+    delete TransImpl;
+    return false;
+  }
+
+  ErrorMsg = "transformation[";
+  ErrorMsg += CurrentTransName;
+  ErrorMsg += "] crashed!";
+  // a crash during a new parse leaves the AST half built
+  if (TransImpl->needsPreprocessor()) {
+    std::string ParseErrorMsg;
+    reparseSource(NULL, ParseErrorMsg);
+  }
+  return false;
+}
+
+bool TransformationManager::queryAllInstances(
+       std::map<std::string, int> &Counts, std::string &ErrorMsg)
+{
+  if (!ClangInstance || SourceHash.empty()) {
+    ErrorMsg = "No source has been loaded!";
+    return false;
+  }
+  if (!TransformationFactoriesMapPtr)
+    return true;
+
+  // One transformation that crashes on this source must not cost the
+  // counts of all the others
+  llvm::CrashRecoveryContext::Enable();
+  std::map<std::string,
+           std::pair<TransformationFactory, const char *> >::iterator I, E;
+  for (I = TransformationFactoriesMapPtr->begin(),
+       E = TransformationFactoriesMapPtr->end();
+       I != E; ++I) {
+    Transformation *TransImpl = createTransformation((*I).first);
+    configureTransformation(TransImpl);
+    TransImpl->setQueryInstanceFlag(true);
+    TransImpl->setTransformationCounter(1);
+    bool Crashed;
+    if (!runOnSourceSafely(TransImpl, Crashed, ErrorMsg)) {
+      delete TransImpl;
+      llvm::CrashRecoveryContext::Disable();
+      return false;
+    }
+    if (Crashed) {
+      // TransImpl is left half-way through its run; leak it rather than
+      // run its destructor
+      Counts[(*I).first] = -1;
+      // a crash during a new parse leaves the AST half built
+      if (TransImpl->needsPreprocessor() && !reparseSource(NULL, ErrorMsg)) {
+        llvm::CrashRecoveryContext::Disable();
+        return false;
+      }
+      continue;
+    }
+    Counts[(*I).first] = TransImpl->getNumTransformationInstances();
+    delete TransImpl;
+  }
+  llvm::CrashRecoveryContext::Disable();
+  return true;
+}
+
+bool TransformationManager::listInstances(
+       std::vector<InstanceInfo> &Instances, std::string &ErrorMsg)
+{
+  if (!ClangInstance || SourceHash.empty()) {
+    ErrorMsg = "No source has been loaded!";
+    return false;
+  }
+
+  Transformation *TransImpl = createTransformation(CurrentTransName);
+  if (!TransImpl) {
+    ErrorMsg = "transformation[";
+    ErrorMsg += CurrentTransName;
+    ErrorMsg += "] cannot be instantiated!";
+    return false;
+  }
+  configureTransformation(TransImpl);
+  TransImpl->setQueryInstanceFlag(true);
+  TransImpl->setTransformationCounter(1);
+  if (!runRequestOnSource(TransImpl, ErrorMsg))
+    return false;
+  NumInstances = TransImpl->getNumTransformationInstances();
+  delete TransImpl;
+
+  for (int Counter = 1; Counter <= NumInstances; ++Counter) {
+    InstanceInfo Info;
+    Info.Counter = Counter;
+    Info.SizeDelta = 0;
+
+    TransImpl = createTransformation(CurrentTransName);
+    configureTransformation(TransImpl);
+    TransImpl->setTransformationCounter(Counter);
+    if (!runRequestOnSource(TransImpl, ErrorMsg))
+      return false;
+    if (TransImpl->transSuccess())
+      TransImpl->getMainFileRanges(Info.Ranges, Info.SizeDelta);
+    else
+      TransImpl->getTransErrorMsg(Info.ErrorMsg);
+    delete TransImpl;
+
+    Instances.push_back(Info);
+  }
+  return true;
+}
+
+namespace {
+
+typedef Transformation::MainFileEdit MainFileEdit;
+
+// Two edits conflict if they touch the same bytes, or insert at the same
+// place, where the order of the insertions would be arbitrary.
+bool editsOverlap(const MainFileEdit &A, const MainFileEdit &B)
+{
+  if (A.Offset == B.Offset)
+    return true;
+  return (A.Offset < B.Offset + B.Length) && (B.Offset < A.Offset + A.Length);
+}
+
+bool editComesLater(const MainFileEdit &A, const MainFileEdit &B)
+{
+  return A.Offset > B.Offset;
+}
+
+}
+
+// Transformations that can only rewrite one instance at a time are run
+// once per instance in [TransformationCounter, ToCounter], each on the
+// same AST, and the edits they make are combined. Each instance may make
+// several edits, which are taken or left out together. An instance whose
+// edits overlap those of an earlier one in the range, or which cannot be
+// performed, fails the whole range with ErrorRangeConflict, so that a
+// result always holds every instance of its range. The source is parsed
+// only once, but each instance still costs a full traversal of the AST,
+// so a range of N instances takes about N times as long as one.
+bool TransformationManager::runTransformationRange(std::string &ErrorMsg,
+                                                   int &ErrorCode)
+{
+  std::vector<MainFileEdit> Edits;
+  std::stringstream Conflicts, Failures;
+  for (int Counter = TransformationCounter; Counter <= ToCounter; ++Counter) {
+    Transformation *TransImpl = createTransformation(CurrentTransName);
+    configureTransformation(TransImpl);
+    TransImpl->setTransformationCounter(Counter);
+    if (!runRequestOnSource(TransImpl, ErrorMsg))
+      return false;
+    NumInstances = TransImpl->getNumTransformationInstances();
+
+    if (TransImpl->isInvalidCounterError()) {
+      if (Counter == TransformationCounter) {
+        TransImpl->getTransErrorMsg(ErrorMsg);
+      }
+      else {
+        ErrorMsg = "The to-counter value exceeded the number of "
+                   "transformation instances!";
+      }
+      ErrorCode = ErrorInvalidCounter;
+      delete TransImpl;
+      return false;
+    }
+
+    std::vector<MainFileEdit> InstanceEdits;
+    if (!TransImpl->transSuccess()) {
+      Failures << " " << Counter;
+    }
+    else if (TransImpl->getMainFileEdits(InstanceEdits)) {
+      bool Conflict = false;
+      for (std::vector<MainFileEdit>::iterator I = InstanceEdits.begin(),
+           E = InstanceEdits.end(); (I != E) && !Conflict; ++I) {
+        for (std::vector<MainFileEdit>::iterator EI = Edits.begin(),
+             EE = Edits.end(); EI != EE; ++EI) {
+          if (editsOverlap(*EI, *I)) {
+            Conflict = true;
+            break;
+          }
+        }
+      }
+      if (Conflict)
+        Conflicts << " " << Counter;
+      else
+        Edits.insert(Edits.end(), InstanceEdits.begin(), InstanceEdits.end());
+    }
+    delete TransImpl;
+  }
+
+  if (!Conflicts.str().empty() || !Failures.str().empty()) {
+    ErrorMsg = "Instances of the range left out:";
+    if (!Conflicts.str().empty())
+      ErrorMsg += " overlapping" + Conflicts.str();
+    if (!Failures.str().empty())
+      ErrorMsg += " failed" + Failures.str();
+    ErrorCode = ErrorRangeConflict;
+    return false;
+  }
+
+  if (Edits.empty()) {
+    ErrorMsg = "No modification to the transformed program!";
+    return false;
+  }
+
+  // apply the edits from the back of the file to the front, so that the
+  // offsets of those still to be applied remain valid
+  std::sort(Edits.begin(), Edits.end(), editComesLater);
+  SourceManager &SrcManager = ClangInstance->getSourceManager();
+  std::string Text =
+    SrcManager.getBufferData(SrcManager.getMainFileID()).str();
+  for (std::vector<MainFileEdit>::iterator I = Edits.begin(),
+       E = Edits.end(); I != E; ++I) {
+    Text.replace((*I).Offset, (*I).Length, (*I).Text);
+  }
+
+  llvm::raw_ostream *OutStream = getOutStream();
+  *OutStream << Text;
+  OutStream->flush();
+  closeOutStream(OutStream);
   return true;
 }
-// Transform changes end
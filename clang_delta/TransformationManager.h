@@ -13,16 +13,23 @@
 
 #include <string>
 #include <map>
+#include <memory>
+#include <vector>
 #include <cassert>
 
 #include "llvm/Support/raw_ostream.h"
+#include "clang/AST/DeclGroup.h"
 
 class Transformation;
 namespace clang {
+  class ASTConsumer;
   class CompilerInstance;
   class Preprocessor;
 }
 
+typedef Transformation *(*TransformationFactory)(const char *TransName,
+                                                 const char *Desc);
+
 class TransformationManager {
 
 public:
@@ -31,9 +38,13 @@ public:
 
   static void Finalize();
 
-  static void registerTransformation(const char *TransName, 
+  static void registerTransformation(const char *TransName,
                                      Transformation *TransImpl);
-  
+
+  static void registerTransformationFactory(const char *TransName,
+                                            const char *Desc,
+                                            TransformationFactory Factory);
+
   static bool isCXXLangOpt();
 
   static bool isCLangOpt();
@@ -44,6 +55,9 @@ public:
 
   static int ErrorInvalidCounter;
 
+  // Some instances of a range could not be combined with the others
+  static int ErrorRangeConflict;
+
   bool doTransformation(std::string &ErrorMsg, int &ErrorCode);
 
   bool verify(std::string &ErrorMsg, int &ErrorCode);
@@ -71,10 +85,19 @@ public:
     SrcFileName = FileName;
   }
 
+  const std::string &getSrcFileName() {
+    return SrcFileName;
+  }
+
   void setOutputFileName(const std::string &FileName) {
     OutputFileName = FileName;
   }
 
+  // Write the transformed source to Buffer instead of a file or stdout
+  void setOutputBuffer(std::string *Buffer) {
+    OutputBuffer = Buffer;
+  }
+
   void setReplacement(const std::string &Str) {
     Replacement = Str;
     DoReplacement = true;
@@ -93,6 +116,13 @@ public:
     return QueryInstanceOnly;
   }
 
+  // Make a transformation that crashes or fails a TransAssert fail the
+  // request instead of ending the process, for programs that link the
+  // transformations (see ClangDeltaSession)
+  void setCrashRecovery(bool Flag) {
+    CrashRecovery = Flag;
+  }
+
   bool initializeCompilerInstance(std::string &ErrorMsg);
 
   void outputNumTransformationInstances();
@@ -101,14 +131,113 @@ public:
 
   void printTransformationNames();
 
+  void getTransformationNames(std::vector<std::string> &Names);
+
   // Transform change start
   Transformation *getTransformation() {
     return CurrentTransformationImpl;
   }
   // Transform change end
 
+  // Session interface: parse a source file once and keep its AST alive,
+  // so that any number of transformations can be run against it without
+  // reparsing. loadSource() only reparses when the contents of FileName
+  // differ from those of the currently loaded source.
+  bool loadSource(const std::string &FileName, std::string &ErrorMsg);
+
+  // Same as loadSource(), for a source held in memory. FileName is only
+  // used to pick the language and to name the file in the AST.
+  bool loadSourceBuffer(const std::string &FileName,
+                        const std::string &Contents,
+                        std::string &ErrorMsg);
+
+  // Drop the source loaded by loadSource() and its AST
+  void resetSource();
+
+  // Run the current transformation, with the current counter settings,
+  // over the AST built by loadSource(). A fresh Transformation object is
+  // created for each run, because transformations keep per-run state.
+  bool runTransformation(std::string &ErrorMsg, int &ErrorCode);
+
+  // Forget the per-request settings (counters, output file, ...) so that
+  // the next request of a session starts from the defaults.
+  void resetRequestOptions();
+
+  const std::string &getSourceHash() {
+    return SourceHash;
+  }
+
+  unsigned getNumParses() {
+    return NumParses;
+  }
+
+  unsigned getNumRuns() {
+    return NumRuns;
+  }
+
+  // Keep the ASTs built by loadSource() in Dir, in serialized form, and
+  // load them from there instead of parsing sources that have been seen
+  // before, possibly by another clang_delta process. Defaults to the value
+  // of CREDUCE_AST_CACHE.
+  void setASTCacheDir(const std::string &Dir) {
+    ASTCacheDir = Dir;
+  }
+
+  bool usesASTCache() {
+    return !ASTCacheDir.empty();
+  }
+
+  unsigned getNumCacheHits() {
+    return NumCacheHits;
+  }
+
+  unsigned getNumCacheMisses() {
+    return NumCacheMisses;
+  }
+
+  // Wall time spent loading cached ASTs and parsing sources, in seconds
+  double getLoadTime() {
+    return LoadTime;
+  }
+
+  double getParseTime() {
+    return ParseTime;
+  }
+
+  // Number of instances seen by the last runTransformation()
+  int getNumInstances() {
+    return NumInstances;
+  }
+
+  // A range of instances of a transformation that rewrites one instance
+  // at a time is run instance by instance on a loaded source, so it needs
+  // loadSource() and runTransformation() instead of doTransformation().
+  bool needsSession();
+
+  // Count the instances of every registered transformation in the source
+  // loaded by loadSource(), each over the same AST. The count of a
+  // transformation that crashes is -1.
+  bool queryAllInstances(std::map<std::string, int> &Counts,
+                         std::string &ErrorMsg);
+
+  // What one instance of a transformation changes in the main file
+  struct InstanceInfo {
+    int Counter;
+    // byte ranges of the original file, see
+    // Transformation::getMainFileRanges()
+    std::vector<std::pair<unsigned, unsigned> > Ranges;
+    int SizeDelta;
+    // set if the instance could not be performed
+    std::string ErrorMsg;
+  };
+
+  // Perform each instance of the current transformation in turn on the
+  // source loaded by loadSource(), and describe what it changes.
+  bool listInstances(std::vector<InstanceInfo> &Instances,
+                     std::string &ErrorMsg);
+
 private:
-  
+
   TransformationManager();
 
   ~TransformationManager();
@@ -117,22 +246,77 @@ private:
 
   void closeOutStream(llvm::raw_ostream *OutStream);
 
+  bool createCompilerInstance(std::unique_ptr<clang::ASTConsumer> Consumer,
+                              std::string &ErrorMsg,
+                              bool OpenMainFile = true);
+
+  bool outputTransformation(Transformation *TransImpl,
+                            std::string &ErrorMsg, int &ErrorCode);
+
+  void configureTransformation(Transformation *TransImpl);
+
+  Transformation *createTransformation(const std::string &Trans);
+
+  void setSource(const std::string &FileName, llvm::StringRef Contents,
+                 bool InMemory);
+
+  bool loadSourceContents(const std::string &FileName,
+                          llvm::StringRef Contents, bool InMemory,
+                          std::string &ErrorMsg);
+
+  bool parseSource(Transformation *Next, std::string &ErrorMsg);
+
+  bool reparseSource(Transformation *Next, std::string &ErrorMsg);
+
+  bool runOnSource(Transformation *TransImpl, std::string &ErrorMsg);
+
+  static void runOnSourceCallback(void *Data);
+
+  bool runOnSourceSafely(Transformation *TransImpl, bool &Crashed,
+                         std::string &ErrorMsg);
+
+  bool runRequestOnSource(Transformation *TransImpl, std::string &ErrorMsg);
+
+  bool runTransformationRange(std::string &ErrorMsg, int &ErrorCode);
+
+  std::string getASTCacheKey(llvm::StringRef Contents);
+
+  bool loadCachedAST(const std::string &Key);
+
+  bool saveCachedAST(const std::string &Key);
+
+  void logCacheEvent(const std::string &Event);
+
   static TransformationManager *Instance;
 
   static std::map<std::string, Transformation *> *TransformationsMapPtr;
 
+  static std::map<std::string, std::pair<TransformationFactory, const char *> >
+    *TransformationFactoriesMapPtr;
+
   std::map<std::string, Transformation *> TransformationsMap;
 
   Transformation *CurrentTransformationImpl;
 
+  // Set once CurrentTransformationImpl has been handed over to (and will
+  // be freed by) ClangInstance.
+  bool CurrentTransformationOwnedByClang;
+
   int TransformationCounter;
 
   int ToCounter;
 
   std::string SrcFileName;
 
+  // Contents of SrcFileName
+  std::string SrcContents;
+
+  bool SrcInMemory;
+
   std::string OutputFileName;
 
+  std::string *OutputBuffer;
+
   std::string CurrentTransName;
 
   clang::CompilerInstance *ClangInstance;
@@ -147,6 +331,31 @@ private:
 
   std::string ReferenceValue;
 
+  bool CrashRecovery;
+
+  // Top-level declaration groups seen while parsing a session's source,
+  // replayed to each transformation run by runTransformation().
+  std::vector<clang::DeclGroupRef> TopLevelDecls;
+
+  // MD5 of the source loaded by loadSource()
+  std::string SourceHash;
+
+  unsigned NumParses;
+
+  unsigned NumRuns;
+
+  int NumInstances;
+
+  std::string ASTCacheDir;
+
+  unsigned NumCacheHits;
+
+  unsigned NumCacheMisses;
+
+  double LoadTime;
+
+  double ParseTime;
+
   // Unimplemented
   TransformationManager(const TransformationManager &);
 
@@ -158,11 +367,19 @@ template<typename TransformationClass>
 class RegisterTransformation {
 
 public:
-  // Since Windows does not support map operation for static allocation,
-  // just drop it.
-  RegisterTransformation(const char *TransName, const char *Desc) {}
+  // Only a factory is recorded at static-initialization time; the
+  // transformation objects themselves are created when the manager is
+  // first used (see TransformationManager::GetInstance).
+  RegisterTransformation(const char *TransName, const char *Desc) {
+    TransformationManager::registerTransformationFactory(TransName, Desc,
+                                                         &create);
+  }
 
 private:
+  static Transformation *create(const char *TransName, const char *Desc) {
+    return new TransformationClass(TransName, Desc);
+  }
+
   // Unimplemented
   RegisterTransformation(const RegisterTransformation &);
 
@@ -0,0 +1,85 @@
+/*===----------------------------------------------------------------------===
+ *
+ * Copyright (c) 2012, 2013, 2015, 2016 The University of Utah
+ * All rights reserved.
+ *
+ * This file is distributed under the University of Illinois Open Source
+ * License.  See the file COPYING for details.
+ *
+ *===----------------------------------------------------------------------===*/
+
+/* The C interface of libclang_delta; see ClangDeltaSession.h for the C++
+ * one. Functions that can fail take an optional "char **error" through
+ * which they return a message, to be released with clang_delta_free().
+ * A process can have only one session at a time. A transformation that
+ * crashes fails the call with CLANG_DELTA_ERROR (or -1) instead of ending
+ * the program. */
+
+#ifndef LIBCLANG_DELTA_H
+#define LIBCLANG_DELTA_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* error codes, as returned by clang_delta_transform() */
+#define CLANG_DELTA_OK 0
+#define CLANG_DELTA_ERROR -1
+#define CLANG_DELTA_ERROR_INVALID_COUNTER 1
+#define CLANG_DELTA_ERROR_RANGE_CONFLICT 2
+
+typedef struct clang_delta_session clang_delta_session;
+
+/* Parse the length bytes at source. file_name is only used to pick the
+ * language, from its extension. Returns NULL on failure. */
+clang_delta_session *clang_delta_session_create(const char *file_name,
+                                                const char *source,
+                                                size_t length,
+                                                char **error);
+
+void clang_delta_session_destroy(clang_delta_session *session);
+
+/* Replace the source of a session; returns 0 on success */
+int clang_delta_set_source(clang_delta_session *session,
+                           const char *source, size_t length,
+                           char **error);
+
+/* The registered transformations, in alphabetical order. The names are
+ * owned by the library. */
+size_t clang_delta_num_transformations(void);
+
+const char *clang_delta_transformation_name(size_t index);
+
+/* Number of instances of a transformation in the source of the session,
+ * or -1 on failure */
+int clang_delta_query_instances(clang_delta_session *session,
+                                const char *transformation,
+                                char **error);
+
+/* Store the number of instances of every transformation in counts, which
+ * has clang_delta_num_transformations() entries, in the same order as
+ * the names; the count of a transformation that crashed is -1. Returns 0
+ * on success. */
+int clang_delta_query_all_instances(clang_delta_session *session,
+                                    int *counts, char **error);
+
+/* Perform instances [counter, to_counter] of a transformation (only
+ * instance counter if to_counter is 0). On success, *result points to the
+ * transformed source, *result_length bytes long and null-terminated,
+ * which the caller releases with clang_delta_free(). Returns one of the
+ * error codes above. */
+int clang_delta_transform(clang_delta_session *session,
+                          const char *transformation,
+                          int counter, int to_counter,
+                          char **result, size_t *result_length,
+                          char **error);
+
+void clang_delta_free(void *ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
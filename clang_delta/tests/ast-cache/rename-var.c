@@ -0,0 +1,15 @@
+// RUN: rm -rf %t
+// RUN: %clang_delta --ast-cache=%t --transformation=rename-var --counter=1 %s 2>&1 | %remove_lit_checks | FileCheck %s
+// RUN: %clang_delta --ast-cache=%t --transformation=rename-var --counter=1 %s 2>&1 | %remove_lit_checks | FileCheck %s
+// RUN: FileCheck --check-prefix=STATS %s < %t/stats
+// STATS: miss
+// STATS-NEXT: hit
+
+struct S {
+// CHECK: int *f1;
+  int *f1;
+};
+// CHECK: int a;
+int abcdef;
+// CHECK-NEXT: struct S b = {&a};
+struct S b = {&abcdef};
@@ -0,0 +1,18 @@
+// RUN: rm -rf %t && mkdir %t
+// RUN: %clang_delta --transformation=remove-unused-var --counters=2,1,3 --output-dir=%t %s | FileCheck --check-prefix=STATUS %s
+// RUN: FileCheck --check-prefix=FIRST %s < %t/1
+// RUN: FileCheck --check-prefix=SECOND %s < %t/2
+// RUN: not %clang_delta --transformation=remove-unused-var --counters= --output-dir=%t %s | FileCheck --check-prefix=EMPTY %s
+// STATUS: 2 ok
+// STATUS-NEXT: 1 ok
+// STATUS-NEXT: 3 error 1
+// EMPTY: Error: Invalid counters[counters=]
+
+void foo() {
+// FIRST-NOT: {{^}}  int a;
+// FIRST: {{^}}  int b;
+// SECOND: {{^}}  int a;
+// SECOND-NOT: {{^}}  int b;
+  int a;
+  int b;
+}
@@ -0,0 +1,15 @@
+// RUN: %clang_delta --transformation=expression-detector --counter=1 %s 2>&1 | %remove_lit_checks | FileCheck %s
+// RUN: rm -rf %t && mkdir %t
+// RUN: %clang_delta --transformation=expression-detector --counters=1 --output-dir=%t %s
+// RUN: %remove_lit_checks < %t/1 | FileCheck %s
+
+// The declaration of printf is left to the header, also when the
+// transformation is run on a parse shared with other runs.
+// CHECK: #include "stdio.h"
+#include "stdio.h"
+// CHECK-NOT: int printf
+// CHECK: printf(
+int foo(int a) {
+  int b = a + 1;
+  return b;
+}
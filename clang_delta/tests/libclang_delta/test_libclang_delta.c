@@ -0,0 +1,207 @@
+/*===----------------------------------------------------------------------===
+ *
+ * Copyright (c) 2018 The University of Utah
+ * All rights reserved.
+ *
+ * This file is distributed under the University of Illinois Open Source
+ * License.  See the file COPYING for details.
+ *
+ *===----------------------------------------------------------------------===*/
+
+/* A driver for the C interface of libclang_delta; see libclang_delta.h.
+ * It is built along with the library and run from lit, through the RUN
+ * line below. */
+
+// RUN: %test_libclang_delta
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libclang_delta.h"
+
+static const char source[] =
+  "void foo() {\n"
+  "  int a;\n"
+  "  int b;\n"
+  "}\n";
+
+static int num_failures = 0;
+
+#define CHECK(cond)                                                     \
+  do {                                                                  \
+    if (!(cond)) {                                                      \
+      fprintf(stderr, "%s:%d: check failed: %s\n",                      \
+              __FILE__, __LINE__, #cond);                               \
+      num_failures++;                                                   \
+    }                                                                   \
+  } while (0)
+
+static clang_delta_session *create_session(const char *src, size_t length)
+{
+  char *error = NULL;
+  clang_delta_session *session =
+    clang_delta_session_create("test.c", src, length, &error);
+
+  if (!session) {
+    fprintf(stderr, "cannot create a session: %s\n",
+            error ? error : "(no message)");
+    clang_delta_free(error);
+  }
+  return session;
+}
+
+static void test_lifetime(void)
+{
+  char *error = NULL;
+  clang_delta_session *session = create_session(source, strlen(source));
+  clang_delta_session *other;
+
+  CHECK(session != NULL);
+
+  /* Only one session at a time */
+  other = clang_delta_session_create("test.c", source, strlen(source),
+                                     &error);
+  CHECK(other == NULL);
+  CHECK(error != NULL);
+  clang_delta_free(error);
+
+  clang_delta_session_destroy(session);
+  clang_delta_session_destroy(NULL);
+
+  /* ... but a new one once the previous one is gone */
+  session = create_session(source, strlen(source));
+  CHECK(session != NULL);
+  clang_delta_session_destroy(session);
+}
+
+static int find_transformation(const char *name)
+{
+  size_t num = clang_delta_num_transformations();
+  size_t i;
+
+  for (i = 0; i < num; i++) {
+    if (!strcmp(clang_delta_transformation_name(i), name))
+      return (int)i;
+  }
+  return -1;
+}
+
+static void test_names(void)
+{
+  size_t num = clang_delta_num_transformations();
+  size_t i;
+
+  CHECK(num > 0);
+  for (i = 0; i < num; i++) {
+    const char *name = clang_delta_transformation_name(i);
+    CHECK(name != NULL);
+    if (name && (i > 0))
+      CHECK(strcmp(clang_delta_transformation_name(i - 1), name) < 0);
+  }
+  CHECK(clang_delta_transformation_name(num) == NULL);
+  CHECK(find_transformation("remove-unused-var") >= 0);
+}
+
+static void test_query(clang_delta_session *session)
+{
+  size_t num = clang_delta_num_transformations();
+  int *counts = (int *)malloc(num * sizeof(int));
+  char *error = NULL;
+  size_t i;
+  int index;
+
+  CHECK(clang_delta_query_instances(session, "remove-unused-var",
+                                    &error) == 2);
+
+  CHECK(clang_delta_query_instances(session, "no-such-transformation",
+                                    &error) == -1);
+  CHECK(error != NULL);
+  clang_delta_free(error);
+  error = NULL;
+
+  /* counts[i] is the count of the i-th name */
+  CHECK(clang_delta_query_all_instances(session, counts, &error) ==
+        CLANG_DELTA_OK);
+  index = find_transformation("remove-unused-var");
+  if (index >= 0)
+    CHECK(counts[index] == 2);
+  for (i = 0; i < num; i++) {
+    const char *name = clang_delta_transformation_name(i);
+    CHECK(counts[i] >= -1);
+    if (counts[i] < 0)
+      continue;
+    if (clang_delta_query_instances(session, name, NULL) != counts[i]) {
+      fprintf(stderr, "query_all_instances disagrees on %s\n", name);
+      num_failures++;
+    }
+  }
+  free(counts);
+}
+
+static void test_transform(clang_delta_session *session)
+{
+  char *result = NULL;
+  size_t result_length = 0;
+  char *error = NULL;
+
+  CHECK(clang_delta_transform(session, "remove-unused-var", 1, 0,
+                              &result, &result_length, &error) ==
+        CLANG_DELTA_OK);
+  CHECK(result != NULL);
+  if (result) {
+    CHECK(result_length < strlen(source));
+    CHECK(strlen(result) == result_length);
+
+    /* One variable is left in the new source */
+    CHECK(clang_delta_set_source(session, result, result_length, &error) ==
+          CLANG_DELTA_OK);
+    CHECK(clang_delta_query_instances(session, "remove-unused-var",
+                                      NULL) == 1);
+    clang_delta_free(result);
+    result = NULL;
+  }
+
+  CHECK(clang_delta_set_source(session, source, strlen(source), &error) ==
+        CLANG_DELTA_OK);
+
+  CHECK(clang_delta_transform(session, "remove-unused-var", 3, 0,
+                              &result, &result_length, &error) ==
+        CLANG_DELTA_ERROR_INVALID_COUNTER);
+  CHECK(result == NULL);
+  CHECK(error != NULL);
+  clang_delta_free(error);
+  error = NULL;
+
+  CHECK(clang_delta_transform(session, "remove-unused-var", 0, 0,
+                              &result, &result_length, &error) ==
+        CLANG_DELTA_ERROR_INVALID_COUNTER);
+  clang_delta_free(error);
+  error = NULL;
+
+  CHECK(clang_delta_transform(session, "no-such-transformation", 1, 0,
+                              &result, &result_length, &error) ==
+        CLANG_DELTA_ERROR);
+  clang_delta_free(error);
+}
+
+int main(void)
+{
+  clang_delta_session *session;
+
+  test_lifetime();
+  test_names();
+
+  session = create_session(source, strlen(source));
+  if (!session)
+    return 1;
+  test_query(session);
+  test_transform(session);
+  clang_delta_session_destroy(session);
+
+  if (num_failures) {
+    fprintf(stderr, "%d check(s) failed\n", num_failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,6 @@
+// RUN: %clang_delta --list-instances=remove-unused-var %s | diff %S/remove-unused-var.expected -
+
+void foo() {
+  int a;
+  int b;
+}
@@ -0,0 +1,7 @@
+// RUN: %clang_delta --list-instances=unify-function-decl %s | diff %S/unify-function-decl.expected -
+
+// The only instance removes the declaration and inserts "static " in front
+// of the definition, which gives a range with nothing removed.
+static int f(void);
+
+int f(void) { return 0; }
@@ -0,0 +1,12 @@
+// RUN: %clang_delta --transformation=remove-unused-field --counter=1 --to-counter=2 %s 2>&1 | %remove_lit_checks | FileCheck %s
+
+// CHECK: struct S {
+struct S {
+// CHECK-NOT: int a;
+  int a;
+// CHECK-NOT: int b;
+  int b;
+// CHECK: int c;
+  int c;
+// CHECK-NEXT: };
+};
@@ -0,0 +1,17 @@
+// RUN: %clang_delta --transformation=remove-unused-field --counter=1 --to-counter=2 %s 2>&1 | %remove_lit_checks | FileCheck %s
+
+// Each instance also removes an initializer, far from the field; the
+// two instances must not be taken for overlapping ones.
+// CHECK: struct S {
+struct S {
+// CHECK-NOT: int a;
+  int a;
+// CHECK-NOT: int b;
+  int b;
+// CHECK: int c;
+  int c;
+// CHECK-NEXT: };
+};
+
+// CHECK: struct S s = {{\{ *}}3};
+struct S s = {1, 2, 3};
@@ -0,0 +1,150 @@
+## -*- mode: Perl -*-
+##
+## Copyright (c) 2012, 2013, 2015, 2016 The University of Utah
+## All rights reserved.
+##
+## This file is distributed under the University of Illinois Open Source
+## License.  See the file COPYING for details.
+
+###############################################################################
+
+# A delta-debugging scheduler for passes whose work consists of removing
+# numbered instances (lines, clang_delta transformation instances, ...)
+# from a file. Such a pass does not implement new/advance/transform
+# itself; it provides
+#
+#   range_count ($cfile, $arg)             number of instances in $cfile
+#   range_apply ($cfile, $arg, $from, $to) remove instances [$from, $to)
+#                                          from $cfile; returns $OK, $STOP
+#                                          if that did not change it, or
+#                                          ($ERROR, message)
+#
+# and optionally
+#
+#   range_prepare ($cfile, $arg)    rewrite $cfile before the first count,
+#                                   returning true if it changed; the
+#                                   rewritten file is a variant of its own
+#   range_min_chunk ($arg)          smallest number of instances to remove
+#                                   at once (default 1)
+#
+# and the driver runs it through the functions below.
+#
+# Each variant removes one chunk of instances, that is, it tests the
+# complement of the chunk. Chunks are taken from the back of the file to
+# the front, so that the instances before a chunk keep their numbers
+# whether or not the chunk's variant is accepted; the next chunk is the
+# same either way. The first sweep uses chunks small enough to give
+# every slot of the parallel window something to test, and each sweep
+# after that halves the chunk size until the minimum has been swept.
+# Within a sweep, successes in a row double the chunk size (up to that
+# of the first sweep), so that a long run of removable instances found
+# late does not have to be removed a few at a time; a failure brings it
+# back down to the sweep's size.
+
+package creduce_ddmin;
+
+use strict;
+use warnings;
+
+use POSIX;
+
+use creduce_utils;
+
+sub has_ranges ($) {
+    (my $method) = @_;
+    no strict "refs";
+    return defined &{$method."::range_apply"};
+}
+
+sub call_pass ($$@) {
+    (my $method, my $fn, my @args) = @_;
+    no strict "refs";
+    my $name = $method."::".$fn;
+    return undef unless defined &{$name};
+    return &{$name}(@args);
+}
+
+sub new ($$$$) {
+    (my $method, my $cfile, my $arg, my $window) = @_;
+    my %sh;
+    $sh{"start"} = 1;
+    $sh{"window"} = ($window > 1) ? $window : 1;
+    my $min = call_pass ($method, "range_min_chunk", $arg);
+    $sh{"min"} = (defined $min && $min > 1) ? $min : 1;
+    return \%sh;
+}
+
+# called when the variant made from $state was not interesting
+sub advance ($$$$) {
+    (my $method, my $cfile, my $arg, my $state) = @_;
+    my %sh = %{$state};
+    delete $sh{"tried"};
+    $sh{"run"} = 0;
+    $sh{"chunk"} = $sh{"base"} if defined $sh{"base"};
+    return \%sh;
+}
+
+# count the instances and start a sweep with chunks of $sh{"base"}
+sub start_sweep ($$$$) {
+    (my $method, my $cfile, my $arg, my $sh) = @_;
+    my $n = call_pass ($method, "range_count", $cfile, $arg);
+    return 0 unless (defined $n && $n > 0);
+    if (!defined ${$sh}{"base"}) {
+        my $c = POSIX::ceil ($n / ${$sh}{"window"});
+        $c = ${$sh}{"min"} if ($c < ${$sh}{"min"});
+        ${$sh}{"base"} = ${$sh}{"top"} = $c;
+    }
+    ${$sh}{"chunk"} = ${$sh}{"base"};
+    ${$sh}{"end"} = $n;
+    ${$sh}{"run"} = 0;
+    print "ddmin: $n instances, chunk ${$sh}{base}\n" if $DEBUG;
+    return 1;
+}
+
+sub transform ($$$$) {
+    (my $method, my $cfile, my $arg, my $state) = @_;
+    my %sh = %{$state};
+
+    if (defined $sh{"start"}) {
+        delete $sh{"start"};
+        return ($OK, \%sh)
+            if call_pass ($method, "range_prepare", $cfile, $arg);
+    }
+    if (!defined $sh{"end"}) {
+        return ($STOP, \%sh) unless start_sweep ($method, $cfile, $arg, \%sh);
+    }
+    if (defined $sh{"tried"}) {
+        # the last variant was interesting
+        delete $sh{"tried"};
+        $sh{"run"}++;
+        if ($sh{"run"} >= 2 && $sh{"chunk"} < $sh{"top"}) {
+            $sh{"chunk"} *= 2;
+            $sh{"chunk"} = $sh{"top"} if ($sh{"chunk"} > $sh{"top"});
+            print "ddmin: chunk grown to $sh{chunk}\n" if $DEBUG;
+        }
+    }
+
+    while (1) {
+        if ($sh{"end"} <= 0) {
+            return ($STOP, \%sh) if ($sh{"base"} <= $sh{"min"});
+            $sh{"base"} = POSIX::ceil ($sh{"base"} / 2);
+            $sh{"base"} = $sh{"min"} if ($sh{"base"} < $sh{"min"});
+            return ($STOP, \%sh) unless start_sweep ($method, $cfile, $arg, \%sh);
+            next;
+        }
+        my $from = $sh{"end"} - $sh{"chunk"};
+        $from = 0 if ($from < 0);
+        (my $res, my $msg) =
+            call_pass ($method, "range_apply", $cfile, $arg, $from, $sh{"end"});
+        return ($ERROR, $msg) if ($res == $ERROR);
+        print "ddmin: removing [$from, $sh{end}) ",
+            ($res == $OK) ? "" : "did not change the file", "\n" if $DEBUG;
+        $sh{"end"} = $from;
+        if ($res == $OK) {
+            $sh{"tried"} = 1;
+            return ($OK, \%sh);
+        }
+    }
+}
+
+1;
@@ -0,0 +1,234 @@
+## -*- mode: Perl -*-
+##
+## Copyright (c) 2012, 2013, 2015, 2016 The University of Utah
+## All rights reserved.
+##
+## This file is distributed under the University of Illinois Open Source
+## License.  See the file COPYING for details.
+
+###############################################################################
+
+# The spawner is a small process forked by the driver at startup, before
+# it has grown large caches, that forks the processes testing variants on
+# the driver's behalf. Forking the driver itself for every test means
+# cloning its page tables, which gets slow once it holds a lot of memory.
+#
+# Protocol, over a pair of pipes:
+#   driver:  "run <dir>\t<arg>\n"
+#   spawner: "pid <pid>\n" (-1 if the fork failed)
+#   spawner: "exit <pid> <wait status> <cpu seconds>\n", whenever a
+#            test process exits
+#
+# The spawner's children change into <dir>, put themselves into their
+# own process group (named by their pid, as for tests forked by the
+# driver) and call the function given to start() with <arg>; it must
+# not return. Since these processes are not the driver's children, the
+# driver collects them with wait_any() and wait_pid() instead of wait().
+
+package creduce_spawner;
+
+use strict;
+use warnings;
+
+use POSIX;
+use IO::Handle;
+use IO::Select;
+use Time::HiRes;
+
+my $spawner_pid;
+my $req;
+my $rep;
+my $buf = "";
+# exits reported by the spawner that the driver has not collected yet
+my %exited = ();
+my @exit_order = ();
+my $children_cpu = 0;
+
+sub active () {
+    return defined $spawner_pid;
+}
+
+# CPU time used by all test processes collected so far
+sub children_cpu () {
+    return $children_cpu;
+}
+
+sub reap ($) {
+    (my $out) = @_;
+    while (1) {
+        my @t0 = times();
+        my $pid = waitpid (-1, WNOHANG);
+        last unless ($pid > 0);
+        my $status = $?;
+        my @t1 = times();
+        printf $out "exit %d %d %.3f\n", $pid, $status,
+            ($t1[2] + $t1[3]) - ($t0[2] + $t0[3]);
+    }
+}
+
+sub spawn_child ($$$$) {
+    (my $out, my $dir, my $arg, my $run) = @_;
+    my $pid = fork();
+    if (!defined $pid) {
+        print $out "pid -1\n";
+        return;
+    }
+    if ($pid == 0) {
+        setpgrp();
+        chdir $dir or POSIX::_exit(1);
+        $run->($arg);
+        POSIX::_exit(1);
+    }
+    # also set the group from this side, so that it exists even if the
+    # driver kills it before the child got to run
+    POSIX::setpgid($pid, $pid);
+    print $out "pid $pid\n";
+}
+
+sub serve ($$$) {
+    (my $in, my $out, my $run) = @_;
+    $out->autoflush(1);
+    # the driver kills what it started itself; the spawner goes away
+    # when the driver closes its end of the request pipe
+    my %saved = map { $_ => $SIG{$_} } qw(INT TERM HUP PIPE);
+    $SIG{$_} = 'IGNORE' foreach (keys %saved);
+    pipe (my $wake_r, my $wake_w) or POSIX::_exit(1);
+    $wake_w->autoflush(1);
+    # a child exiting while we are in select() wakes it up through the
+    # pipe; one exiting just before is caught by reap() on the next turn
+    $SIG{CHLD} = sub { syswrite ($wake_w, "x"); };
+    my $child_run = sub {
+        close $in;
+        close $out;
+        close $wake_r;
+        close $wake_w;
+        $SIG{CHLD} = 'DEFAULT';
+        $SIG{$_} = $saved{$_} foreach (keys %saved);
+        $run->(@_);
+    };
+    my $sel = IO::Select->new($in, $wake_r);
+    my $inbuf = "";
+    while (1) {
+        reap ($out);
+        foreach my $fh ($sel->can_read()) {
+            if ($fh == $wake_r) {
+                sysread ($wake_r, my $junk, 64);
+                next;
+            }
+            my $n = sysread ($in, $inbuf, 4096, length($inbuf));
+            return unless $n;
+            while ($inbuf =~ s/^([^\n]*)\n//) {
+                next unless ($1 =~ /^run ([^\t]*)\t(.*)$/);
+                spawn_child ($out, $1, $2, $child_run);
+            }
+        }
+    }
+}
+
+# Fork the spawner. $run is called in each test process with the
+# argument passed to spawn(). Returns false if the spawner could not be
+# started, in which case the driver forks tests itself.
+sub start ($) {
+    (my $run) = @_;
+    pipe (my $req_r, my $req_w) or return 0;
+    pipe (my $rep_r, my $rep_w) or return 0;
+    my $pid = fork();
+    return 0 unless defined $pid;
+    if ($pid == 0) {
+        close $req_w;
+        close $rep_r;
+        serve ($req_r, $rep_w, $run);
+        POSIX::_exit(0);
+    }
+    close $req_r;
+    close $rep_w;
+    $req_w->autoflush(1);
+    ($spawner_pid, $req, $rep) = ($pid, $req_w, $rep_r);
+    return 1;
+}
+
+sub stop () {
+    return unless defined $spawner_pid;
+    close $req;
+    close $rep;
+    waitpid ($spawner_pid, 0);
+    undef $spawner_pid;
+}
+
+# the next message from the spawner, or undef if none arrived within
+# $timeout seconds (undef: wait for one)
+sub read_message ($) {
+    (my $timeout) = @_;
+    while ($buf !~ /\n/) {
+        my $sel = IO::Select->new($rep);
+        return undef unless $sel->can_read($timeout);
+        my $n = sysread ($rep, $buf, 4096, length($buf));
+        die "the spawner went away\n" unless $n;
+    }
+    $buf =~ s/^([^\n]*)\n//;
+    return $1;
+}
+
+sub note_exit ($) {
+    (my $msg) = @_;
+    return unless ($msg =~ /^exit ([0-9]+) (-?[0-9]+) ([0-9.]+)$/);
+    $exited{$1} = $2;
+    push @exit_order, $1;
+    $children_cpu += $3;
+}
+
+# Start a test process in $dir. Returns its pid, which is also the id
+# of its process group, or -1 if it could not be forked.
+sub spawn ($$) {
+    (my $dir, my $arg) = @_;
+    die "bad spawner request" if ("$dir$arg" =~ /\n/ || $dir =~ /\t/);
+    print $req "run $dir\t$arg\n";
+    while (1) {
+        my $msg = read_message (undef);
+        next unless defined $msg;
+        return $1 if ($msg =~ /^pid (-?[0-9]+)$/);
+        note_exit ($msg);
+    }
+}
+
+# Wait up to $timeout seconds (undef: as long as it takes) for a test
+# process to exit. Returns its pid and wait status, or an empty list if
+# none exited in time.
+sub wait_any ($) {
+    (my $timeout) = @_;
+    my $end = (defined $timeout) ? Time::HiRes::time() + $timeout : undef;
+    while (!@exit_order) {
+        my $left = (defined $end) ? $end - Time::HiRes::time() : undef;
+        $left = 0 if (defined $left && $left < 0);
+        my $msg = read_message ($left);
+        if (defined $msg) {
+            note_exit ($msg);
+        } elsif (defined $left && $left == 0) {
+            return ();
+        }
+    }
+    my $pid = shift @exit_order;
+    return ($pid, delete $exited{$pid});
+}
+
+# Wait up to $timeout seconds (undef: as long as it takes) for the given
+# test process to exit; returns its wait status, or undef if it did not
+# exit in time.
+sub wait_pid ($;$) {
+    (my $pid, my $timeout) = @_;
+    my $end = (defined $timeout) ? Time::HiRes::time() + $timeout : undef;
+    while (!exists $exited{$pid}) {
+        my $left = (defined $end) ? $end - Time::HiRes::time() : undef;
+        $left = 0 if (defined $left && $left < 0);
+        my $msg = read_message ($left);
+        if (defined $msg) {
+            note_exit ($msg);
+        } elsif (defined $left && $left == 0) {
+            return undef;
+        }
+    }
+    @exit_order = grep { $_ != $pid } @exit_order;
+    return delete $exited{$pid};
+}
+
+1;
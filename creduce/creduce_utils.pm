@@ -12,19 +12,27 @@ package creduce_utils;
 
 use warnings;
 
+use Digest::SHA;
 use Exporter::Lite;
 use File::Spec;
 use File::Which;
+use IO::Handle;
+use JSON::PP;
+use POSIX;
 
 @EXPORT      = qw($DEBUG $OK $STOP $ERROR
+		  $CLANG_DELTA_SERVER $CLANG_DELTA_BATCH
 		  find_external_program
 		  runit nprocs
-                  run_clang_delta
+                  run_clang_delta run_clang_delta_server
+		  clang_delta_instances
 		  $replace_cont $matched replace_aux
-		  read_file write_file
+		  read_file write_file text_edit
                   );
 
 $DEBUG = 0;
+$CLANG_DELTA_SERVER = 0;
+$CLANG_DELTA_BATCH = 1;
 
 $OK = 999999;
 $STOP = 111333;
@@ -61,6 +69,10 @@ sub run_clang_delta ($) {
         elsif ($res == 1) {
             return -2;
         }
+        elsif ($res == 2) {
+            # some instances of a --to-counter range could not be combined
+            return -4;
+        }
         else {
             return -3;
         }
@@ -68,6 +80,158 @@ sub run_clang_delta ($) {
     return ($? >> 8);
 }
 
+# A clang_delta started with --server keeps the AST of the last source
+# it was asked about, so consecutive requests against the same file are
+# answered without reparsing. There is at most one server at a time; it
+# is restarted on demand if it dies or a different clang_delta is used.
+my $server_prog;
+my $server_req;
+my $server_rep;
+
+sub stop_clang_delta_server () {
+    close $server_req if defined $server_req;
+    close $server_rep if defined $server_rep;
+    undef $server_req;
+    undef $server_rep;
+    undef $server_prog;
+}
+
+sub start_clang_delta_server ($) {
+    (my $prog) = @_;
+    my ($req_r, $req_w, $rep_r, $rep_w);
+    pipe ($req_r, $req_w) or return 0;
+    pipe ($rep_r, $rep_w) or return 0;
+    # fork twice so that the server is not our child; the driver reaps
+    # its children with wait() and must not see the server exit
+    my $pid = fork();
+    return 0 unless defined $pid;
+    if ($pid == 0) {
+        my $gpid = fork();
+        POSIX::_exit(1) unless defined $gpid;
+        if ($gpid == 0) {
+            close $req_w;
+            close $rep_r;
+            open STDIN, "<&", $req_r or POSIX::_exit(1);
+            open STDOUT, ">&", $rep_w or POSIX::_exit(1);
+            open STDERR, ">", File::Spec->devnull() unless $DEBUG;
+            chdir "/";
+            { exec $prog, "--server" };
+            POSIX::_exit(1);
+        }
+        POSIX::_exit(0);
+    }
+    waitpid ($pid, 0);
+    close $req_r;
+    close $rep_w;
+    $req_w->autoflush(1);
+    $server_req = $req_w;
+    $server_rep = $rep_r;
+    $server_prog = $prog;
+    print "started clang_delta server\n" if $DEBUG;
+    return 1;
+}
+
+sub clang_delta_server_request ($$) {
+    (my $prog, my $request) = @_;
+    stop_clang_delta_server()
+        if (defined $server_prog && $server_prog ne $prog);
+    if (!defined $server_req) {
+        return undef unless start_clang_delta_server ($prog);
+    }
+    local $SIG{PIPE} = 'IGNORE';
+    my $reply;
+    if (print $server_req "$request\n") {
+        $reply = readline ($server_rep);
+    }
+    if (!defined $reply) {
+        print "clang_delta server went away\n" if $DEBUG;
+        stop_clang_delta_server();
+        return undef;
+    }
+    chomp $reply;
+    return $reply;
+}
+
+# Send a request to the clang_delta server. Returns the same codes as
+# run_clang_delta(), plus the instance count for queries, or undef if
+# the server could not answer; callers then fall back to running
+# clang_delta directly, which also gets crashes reported as usual. As
+# with a redirected one-shot run, error messages end up in $output.
+sub run_clang_delta_server ($$$@) {
+    (my $prog, my $output, my $cmd, my @args) = @_;
+    foreach my $a (@args) {
+        return undef if ($a =~ /[\t\n]/);
+    }
+    my $reply = clang_delta_server_request ($prog, join ("\t", $cmd, @args));
+    return undef unless defined $reply;
+    if ($reply =~ /^ok(?: ([0-9]+))?$/) {
+        return (0, $1);
+    }
+    if ($reply =~ /^error (-?[0-9]+) (.*)$/) {
+        my $code = $1;
+        write_file ($output, "Error: $2\n") if defined $output;
+        return -2 if ($code == 1);
+        return -4 if ($code == 2);
+        return -1;
+    }
+    stop_clang_delta_server();
+    return undef;
+}
+
+# The instance counts of every transformation, from a single parse by
+# clang_delta --query-all-instances, are kept for the last version of a
+# file asked about, so that the clang passes can skip transformations
+# that have nothing to do without running clang_delta at all. A
+# transformation that crashed while counting gets -1 and is left out, so
+# that it is run, and the crash reported, as usual.
+my $instances_key = "";
+my %instances = ();
+
+sub query_all_instances ($$) {
+    (my $prog, my $cfile) = @_;
+    my $json;
+    if ($CLANG_DELTA_SERVER) {
+        my $reply = clang_delta_server_request
+            ($prog, join ("\t", "query-all", File::Spec->rel2abs($cfile)));
+        $json = $1 if (defined $reply && $reply =~ /^ok (\{.*\})$/);
+    }
+    if (!defined $json) {
+        my $devnull = File::Spec->devnull();
+        open INF, qq{"$prog" --query-all-instances $cfile 2>$devnull |}
+            or return ();
+        $json = <INF>;
+        close INF;
+    }
+    my $counts;
+    $counts = eval { JSON::PP::decode_json ($json) } if defined $json;
+    if (ref($counts) ne "HASH") {
+        print "clang_delta --query-all-instances failed on $cfile\n"
+            if $DEBUG;
+        return ();
+    }
+    foreach my $which (keys %{$counts}) {
+        next if ($counts->{$which} >= 0);
+        print "clang_delta crashed counting instances of $which\n" if $DEBUG;
+        delete $counts->{$which};
+    }
+    return %{$counts};
+}
+
+# Number of instances of transformation $which in $cfile, or undef if
+# clang_delta could not tell
+sub clang_delta_instances ($$$) {
+    (my $prog, my $cfile, my $which) = @_;
+    # the language depends on the file name's extension
+    (my $ext) = ($cfile =~ /(\.[^.\/]*)$/);
+    my $key = Digest::SHA->new(1)->addfile($cfile)->hexdigest() .
+        ((defined $ext) ? $ext : "");
+    if ($key ne $instances_key) {
+        %instances = query_all_instances ($prog, $cfile);
+        $instances_key = $key;
+    }
+    return $instances{$which};
+}
+
 # utility code to help us replace the nth occurrence of a pattern
 $replace_cont = 0;
 $matched = 0;
@@ -96,6 +260,21 @@ sub write_file ($$) {
     close OUTF;
 }
 
+# the edit [offset, length, replacement] that turns $old into $new,
+# found by skipping their common prefix and suffix
+sub text_edit ($$) {
+    (my $old, my $new) = @_;
+    my $min = (length($old) < length($new)) ? length($old) : length($new);
+    my $p = (($old ^ $new) =~ /^(\0*)/) ? length($1) : 0;
+    $p = $min if ($p > $min);
+    my $rold = reverse substr($old, $p);
+    my $rnew = reverse substr($new, $p);
+    my $s = (($rold ^ $rnew) =~ /^(\0*)/) ? length($1) : 0;
+    $s = $min - $p if ($s > $min - $p);
+    return [$p, length($old) - $p - $s,
+            substr($new, $p, length($new) - $p - $s)];
+}
+
 # attempt to find number of real cores, not hyperthreaded ones
 sub ncpus () {
     my $OS = $^O;
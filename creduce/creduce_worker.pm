@@ -0,0 +1,256 @@
+## -*- mode: Perl -*-
+##
+## Copyright (c) 2012, 2013, 2015, 2016 The University of Utah
+## All rights reserved.
+##
+## This file is distributed under the University of Illinois Open Source
+## License.  See the file COPYING for details.
+
+###############################################################################
+
+# Remote test workers. A worker daemon (creduce --serve-worker <addr>)
+# accepts one connection per variant, receives the interestingness test
+# and the files being reduced, runs the test in a private temporary
+# directory, and answers with its exit code and wall time. If the
+# connection goes away before the test is done, the test is killed;
+# that is how killem() in the driver cancels remote work.
+#
+# Addresses are either "unix:<path>" or "<host>:<port>".
+#
+# A worker runs whatever script it is sent, so it only listens where
+# nobody else can reach it: on a unix socket that only its user can
+# connect to, or on a loopback address. Other addresses need a shared
+# secret in CREDUCE_WORKER_SECRET, on the worker and on the clients;
+# clients prove they know it by hashing it with a nonce of the worker.
+# The connection itself is not encrypted.
+#
+# Protocol, all on one connection:
+#   worker: "CREDUCE-WORKER 1 <nonce>\n"
+#   client: "CREDUCE-WORKER 1 <HMAC-SHA256 of the nonce, in hex>\n"
+#   client: "TEST <name> <length>\n" followed by the test script
+#   client: "FILE <name> <length>\n" followed by the file, repeated
+#   client: "RUN\n"
+#   worker: "RESULT <exit code> <wall seconds>\n"
+
+package creduce_worker;
+
+use strict;
+use warnings;
+
+use POSIX;
+use Digest::SHA qw(hmac_sha256_hex);
+use File::Basename;
+use File::Path;
+use File::Spec;
+use File::Temp;
+use IO::Handle;
+use IO::Select;
+use IO::Socket::INET;
+use IO::Socket::UNIX;
+use Time::HiRes;
+
+my $HELLO = "CREDUCE-WORKER 1";
+
+sub secret () {
+    my $secret = $ENV{"CREDUCE_WORKER_SECRET"};
+    return (defined $secret && $secret ne "") ? $secret : undef;
+}
+
+sub new_nonce () {
+    my $bytes;
+    if (open my $inf, "<", "/dev/urandom") {
+        binmode $inf;
+        read ($inf, $bytes, 16);
+        close $inf;
+    }
+    $bytes = join ("", map { chr(int(rand(256))) } 1..16)
+        unless (defined $bytes && length($bytes) == 16);
+    return unpack ("H*", $bytes);
+}
+
+sub answer ($) {
+    (my $nonce) = @_;
+    my $secret = secret();
+    return hmac_sha256_hex ($nonce, (defined $secret) ? $secret : "");
+}
+
+sub read_bytes ($) {
+    (my $file) = @_;
+    open my $inf, "<", $file or return undef;
+    binmode $inf;
+    local $/;
+    my $data = <$inf>;
+    close $inf;
+    return (defined $data) ? $data : "";
+}
+
+sub connect_worker ($) {
+    (my $addr) = @_;
+    if ($addr =~ /^unix:(.*)$/) {
+        return IO::Socket::UNIX->new(Type => SOCK_STREAM, Peer => $1);
+    }
+    return IO::Socket::INET->new(PeerAddr => $addr, Proto => "tcp");
+}
+
+sub send_blob ($$$$) {
+    (my $sock, my $kind, my $name, my $data) = @_;
+    print $sock "$kind $name " . length($data) . "\n" . $data;
+}
+
+# Run $test remotely on the given files, which are in the current
+# directory. Returns the test's exit code and wall time, or an empty
+# list if the worker could not be reached.
+sub run_remote ($$@) {
+    (my $addr, my $test, my @files) = @_;
+    my $sock = connect_worker ($addr) or return ();
+    binmode $sock;
+    local $SIG{PIPE} = 'IGNORE';
+    my $hello = <$sock>;
+    return () unless (defined $hello && $hello =~ /^$HELLO ([0-9a-f]+)\n$/);
+    print $sock "$HELLO " . answer ($1) . "\n";
+    my $script = read_bytes ($test);
+    return () unless defined $script;
+    send_blob ($sock, "TEST", basename($test), $script);
+    foreach my $f (@files) {
+        my $data = read_bytes ($f);
+        return () unless defined $data;
+        send_blob ($sock, "FILE", $f, $data);
+    }
+    print $sock "RUN\n";
+    my $line = <$sock>;
+    close $sock;
+    return () unless (defined $line && $line =~ /^RESULT (-?[0-9]+) ([0-9.]+)$/);
+    return ($1, $2);
+}
+
+sub receive_job ($$$) {
+    (my $conn, my $dir, my $testdir) = @_;
+    my $test;
+    while (my $line = <$conn>) {
+        return $test if ($line eq "RUN\n");
+        return undef unless ($line =~ /^(TEST|FILE) ([^\/\s]+) ([0-9]+)\n$/);
+        (my $kind, my $name, my $len) = ($1, $2, $3);
+        return undef if ($name eq "." || $name eq "..");
+        my $data = "";
+        while (length($data) < $len) {
+            my $n = read ($conn, $data, $len - length($data), length($data));
+            return undef unless $n;
+        }
+        my $path = File::Spec->catfile(($kind eq "TEST") ? $testdir : $dir,
+                                       $name);
+        open my $outf, ">", $path or return undef;
+        binmode $outf;
+        print $outf $data;
+        close $outf;
+        if ($kind eq "TEST") {
+            chmod 0755, $path;
+            $test = $path;
+        }
+    }
+    return undef;
+}
+
+sub handle_job ($) {
+    (my $conn) = @_;
+    binmode $conn;
+    my $nonce = new_nonce();
+    {
+        local $SIG{PIPE} = 'IGNORE';
+        print $conn "$HELLO $nonce\n";
+        $conn->flush();
+    }
+    my $hello = <$conn>;
+    return unless (defined $hello && $hello =~ /^$HELLO ([0-9a-f]+)\n$/);
+    my $proof = $1;
+    # without a secret, only the local user can have connected
+    return if (defined secret() && $proof ne answer ($nonce));
+
+    my $dir = File::Temp::tempdir("creduce-worker-XXXXXX", TMPDIR => 1);
+    my $testdir = File::Temp::tempdir("creduce-worker-XXXXXX", TMPDIR => 1);
+    my $test = receive_job ($conn, $dir, $testdir);
+    if (!defined $test) {
+        rmtree ([$dir, $testdir]);
+        return;
+    }
+
+    my $start = Time::HiRes::time();
+    my $pid = fork();
+    if (!defined $pid) {
+        rmtree ([$dir, $testdir]);
+        return;
+    }
+    if ($pid == 0) {
+        setpgrp();
+        chdir $dir or POSIX::_exit(127);
+        open STDOUT, ">", File::Spec->devnull();
+        open STDERR, ">", File::Spec->devnull();
+        { exec $test };
+        POSIX::_exit(127);
+    }
+
+    # wait for the test, unless the client goes away first
+    my $sel = IO::Select->new($conn);
+    my $status;
+    while (1) {
+        if (waitpid ($pid, WNOHANG) == $pid) {
+            $status = $?;
+            last;
+        }
+        if ($sel->can_read(0.01)) {
+            my $buf;
+            if (!sysread ($conn, $buf, 1)) {
+                kill ('TERM', -$pid);
+                waitpid ($pid, 0);
+                last;
+            }
+        }
+    }
+    if (defined $status) {
+        my $code = ($status & 127) ? -1 : ($status >> 8);
+        local $SIG{PIPE} = 'IGNORE';
+        printf $conn "RESULT %d %.3f\n", $code, Time::HiRes::time() - $start;
+    }
+    close $conn;
+    rmtree ([$dir, $testdir]);
+}
+
+sub serve ($) {
+    (my $addr) = @_;
+    my $listen;
+    if ($addr =~ /^unix:(.*)$/) {
+        unlink $1;
+        # connecting needs write permission on the socket
+        my $umask = umask (077);
+        $listen = IO::Socket::UNIX->new(Type => SOCK_STREAM, Local => $1,
+                                        Listen => SOMAXCONN);
+        umask ($umask);
+    } else {
+        $listen = IO::Socket::INET->new(LocalAddr => $addr, Proto => "tcp",
+                                        Listen => SOMAXCONN, ReuseAddr => 1);
+    }
+    die "cannot listen on '$addr': $!\n" unless defined $listen;
+    if ($addr !~ /^unix:/ && $listen->sockhost() !~ /^127\./ &&
+        !defined secret()) {
+        die "refusing to run tests for anyone who can reach '$addr': " .
+            "listen on a unix: or loopback address, or set " .
+            "CREDUCE_WORKER_SECRET\n";
+    }
+    STDOUT->autoflush(1);
+    print "C-Reduce worker listening on $addr\n";
+    # the driver's handlers clean up after a reduction, there is none
+    $SIG{$_} = 'DEFAULT' foreach (qw(TERM INT HUP));
+    $SIG{CHLD} = 'IGNORE';
+    while (1) {
+        my $conn = $listen->accept() or next;
+        my $pid = fork();
+        if (defined $pid && $pid == 0) {
+            close $listen;
+            $SIG{CHLD} = 'DEFAULT';
+            handle_job ($conn);
+            POSIX::_exit(0);
+        }
+        close $conn;
+    }
+}
+
+1;
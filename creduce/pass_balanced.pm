@@ -46,15 +46,13 @@ sub remove_outside ($) {
 # trying to get nested matches out of Perl's various utilities for
 # matching balanced delimiters, with no success
 
-sub transform ($$$) {
-    (my $cfile, my $arg, my $state) = @_;
-
-    my $pos = ${$state};
-    my $prog = read_file ($cfile);
+# returns the status, the new position and, for $OK, the edit
+# [offset, length, replacement] to make to $prog
+sub find_edit ($$$) {
+    (my $prog, my $arg, my $pos) = @_;
 
     while (1) {
 
-	my $first = substr ($prog, 0, $pos);
 	my $rest = substr ($prog, $pos);
 	my $rest2 = $rest;
 
@@ -93,14 +91,36 @@ sub transform ($$$) {
 	    return ($ERROR, "unexpected argument");
 	}
 	if ($rest ne $rest2) {
-	    write_file ($cfile, $first . $rest2);
-	    return ($OK, \$pos);
+	    my $edit = text_edit ($rest, $rest2);
+	    ${$edit}[0] += $pos;
+	    return ($OK, $pos, $edit);
 	}
 	$pos++;
 	if ($pos > length($prog)) {
-	    return ($STOP, \$pos);
+	    return ($STOP, $pos);
 	}
     }
 }
 
+sub transform ($$$) {
+    (my $cfile, my $arg, my $state) = @_;
+
+    my $prog = read_file ($cfile);
+    (my $res, my $pos, my $edit) = find_edit ($prog, $arg, ${$state});
+    return ($res, $pos) if ($res == $ERROR);
+    if ($res == $OK) {
+	substr ($prog, ${$edit}[0], ${$edit}[1]) = ${$edit}[2];
+	write_file ($cfile, $prog);
+    }
+    return ($res, \$pos);
+}
+
+sub transform_edit ($$$) {
+    (my $prog, my $arg, my $state) = @_;
+
+    (my $res, my $pos, my $edit) = find_edit ($prog, $arg, ${$state});
+    return ($res, $pos) if ($res == $ERROR);
+    return ($res, \$pos, ($res == $OK) ? [ $edit ] : []);
+}
+
 1;
@@ -16,8 +16,10 @@ use warnings;
 use POSIX;
 
 use Cwd 'abs_path';
+use Digest::SHA;
 use File::Copy;
 use File::Spec;
+use File::Temp;
 
 use creduce_config qw(bindir libexecdir);
 use creduce_regexes;
@@ -54,6 +56,48 @@ sub check_prereqs () {
     return 0;
 }
 
+# Variants produced ahead of time by a single clang_delta run with
+# --counters, for the source whose digest is $batch_digest.
+my $batch_dir;
+my $batch_digest = "";
+my $batch_which = "";
+my %batch_status;
+
+sub file_digest ($) {
+    (my $cfile) = @_;
+    my $sha = Digest::SHA->new(1);
+    $sha->addfile($cfile);
+    return $sha->hexdigest();
+}
+
+# Ask clang_delta for the variants of counters $index and up, so that
+# the following calls of transform() for the same source do not need to
+# reparse it. Returns false if clang_delta could not be run this way.
+sub run_batch ($$$$) {
+    (my $cfile, my $which, my $index, my $digest) = @_;
+    $batch_dir = File::Temp::tempdir("clang_delta-XXXXXX",
+                                     TMPDIR => 1, CLEANUP => 1)
+        unless defined $batch_dir;
+    unlink glob("$batch_dir/*");
+    %batch_status = ();
+    $batch_digest = "";
+    my $last = $index + $CLANG_DELTA_BATCH - 1;
+    my $counters = join(",", $index..$last);
+    my $cmd = qq{"$clang_delta" --transformation=$which --counters=$counters --output-dir=$batch_dir $cfile};
+    print "$cmd\n" if $DEBUG;
+    open INF, "$cmd |" or return 0;
+    while (my $line = <INF>) {
+        $batch_status{$1} = $2 if ($line =~ /^([0-9]+) (ok|error -?[0-9]+)/);
+    }
+    close INF;
+    # a crash leaves the remaining counters without an answer; those
+    # are rerun one at a time, so the crash gets reported as usual
+    return 0 unless defined $batch_status{$index};
+    $batch_digest = $digest;
+    $batch_which = $which;
+    return 1;
+}
+
 sub new ($$) {
     my $index = 1;
     return \$index;
@@ -69,10 +113,34 @@ sub advance ($$$) {
 sub transform ($$$) {
     (my $cfile, my $which, my $state) = @_;
     my $index = ${$state};
+    if ($index == 1) {
+        my $n = clang_delta_instances ($clang_delta, $cfile, $which);
+        if (defined $n && $n == 0) {
+            print "no instances of $which\n" if $DEBUG;
+            return ($STOP, \$index);
+        }
+    }
     my $tmpfile = File::Temp::tmpnam();
     my $cmd = qq{"$clang_delta" --transformation=$which --counter=$index $cfile};
     print "$cmd\n" if $DEBUG;
-    my $res = run_clang_delta ("$cmd > $tmpfile");
+    my $res;
+    ($res) = run_clang_delta_server ($clang_delta, $tmpfile, "transform",
+                                     $which, $index, 0,
+                                     File::Spec->rel2abs($cfile), $tmpfile)
+        if $CLANG_DELTA_SERVER;
+    if (!defined $res && !$CLANG_DELTA_SERVER && $CLANG_DELTA_BATCH > 1) {
+        my $digest = file_digest($cfile);
+        if ($digest ne $batch_digest || $which ne $batch_which ||
+            !defined $batch_status{$index}) {
+            run_batch($cfile, $which, $index, $digest);
+        }
+        if ($digest eq $batch_digest && defined $batch_status{$index}) {
+            return ($STOP, \$index) if ($batch_status{$index} ne "ok");
+            return ($OK, \$index)
+                if File::Copy::copy("$batch_dir/$index", $cfile);
+        }
+    }
+    $res = run_clang_delta ("$cmd > $tmpfile") unless defined $res;
     if ($res==0) {
 	File::Copy::move($tmpfile, $cfile);
 	return ($OK, \$index);
@@ -30,6 +30,14 @@ my $ORIG_DIR;
 
 sub count_instances ($$) {
     (my $cfile, my $which) = @_;
+    my $all = clang_delta_instances ($clang_delta, $cfile, $which);
+    return $all if defined $all;
+    if ($CLANG_DELTA_SERVER) {
+        (my $res, my $n) = run_clang_delta_server ($clang_delta, undef, "query",
+                                                   $which,
+                                                   File::Spec->rel2abs($cfile));
+        return $n if (defined $res && $res == 0);
+    }
     open INF, qq{"$clang_delta" --query-instances=$which $cfile |} or die;
     my $line = <INF>;
     my $n = 0;
@@ -66,92 +74,52 @@ sub check_prereqs () {
     return 0;
 }
 
-sub new ($$) {
-    (my $cfile, my $which) = @_;
-    my %sh;
-    $sh{"start"} = 1;
-    return \%sh;
-}
+# Instances are removed by the ddmin scheduler in creduce_ddmin.pm; a
+# chunk of instances [from, to) is counters from+1 to to of clang_delta.
 
-sub advance ($$$) {
-    (my $cfile, my $which, my $state) = @_;
-    my %sh = %{$state};
-    return \%sh if defined($sh{"start"});
-    $sh{"index"} += $sh{"chunk"};
-    if ($DEBUG) {
-	my $index = $sh{"index"};
-	my $chunk = $sh{"chunk"};
-	print "ADVANCE: index = $index, chunk = $chunk\n";
-    }
-    return \%sh;
+sub range_count ($$) {
+    (my $cfile, my $which) = @_;
+    my $instances = count_instances($cfile,$which);
+    print "instances = $instances\n" if $DEBUG;
+    return $instances;
 }
 
-sub round ($) {
-    (my $n) = @_;
-    return int ($n+0.5);
+# smaller chunks are left to pass_clang, one instance at a time
+sub range_min_chunk ($) {
+    (my $which) = @_;
+    return 5;
 }
 
-sub transform ($$$) {
-    (my $cfile, my $which, my $state) = @_;
-    my %sh = %{$state};
-
-    if (defined($sh{"start"})) {
-	delete $sh{"start"};
-	my $instances = count_instances($cfile,$which);
-	$sh{"chunk"} = $instances;
-	$sh{"instances"} = $instances;
-	print "initial granularity = $instances\n" if $DEBUG;
-	$sh{"index"} = 1;
-    }
-
-  AGAIN:
-
-    my $n=0;
-    my $index = $sh{"index"};
-    my $chunk = $sh{"chunk"};
-    my $instances = $sh{"instances"};
+sub range_apply ($$$$) {
+    (my $cfile, my $which, my $from, my $to) = @_;
+    my $index = $from + 1;
     my $tmpfile = File::Temp::tmpnam();
 
-    print "TRANSFORM: index = $index, chunk = $chunk, instances = $instances\n" if $DEBUG;
-
-    if ($index <= $instances) {
-	my $end = $index + $chunk;
-	if ($end > $instances) {
-	    $end = $instances;
-	}
-
-	my $dec = $end - $index + 1;
-
-	my $cmd = qq{"$clang_delta" --transformation=$which --counter=$index --to-counter=$end $cfile};
-	print "$cmd\n" if $DEBUG;
-	my $res = run_clang_delta ("$cmd > $tmpfile");
-
-	if ($res==0) {
-	    File::Copy::move($tmpfile, $cfile);
-	    return ($OK, \%sh);
-	} else {
-	    if ($res == -1) {
-		# nothing?
-	    } elsif ($res == -2) {
-		unlink $tmpfile;
-		print "out of instances!\n" if $DEBUG;
-		goto rechunk;
-	    } else {
-		unlink $tmpfile;
-		return ($ERROR, "crashed: $cmd");
-	    }
-	}
-	File::Copy::move($tmpfile, $cfile);
-    } else {
-      rechunk:
-	return ($STOP, \%sh) if ($sh{"chunk"} < 10);
-	my $newchunk = round ($sh{"chunk"} / 2.0);
-	$sh{"chunk"} = $newchunk;
-	print "granularity = $newchunk\n" if $DEBUG;
-	$sh{"index"} = 1;
-	goto AGAIN;
+    my $cmd = qq{"$clang_delta" --transformation=$which --counter=$index --to-counter=$to $cfile};
+    print "$cmd\n" if $DEBUG;
+    my $res;
+    ($res) = run_clang_delta_server ($clang_delta, $tmpfile, "transform",
+				     $which, $index, $to,
+				     File::Spec->rel2abs($cfile), $tmpfile)
+	if $CLANG_DELTA_SERVER;
+    $res = run_clang_delta ("$cmd > $tmpfile") unless defined $res;
+
+    if ($res == -2) {
+	unlink $tmpfile;
+	print "out of instances!\n" if $DEBUG;
+	return $STOP;
+    } elsif ($res == -4) {
+	# the chunk is skipped; later sweeps try it in smaller pieces
+	print "instances of the chunk conflict: ", read_file ($tmpfile)
+	    if $DEBUG;
+	unlink $tmpfile;
+	return $STOP;
+    } elsif ($res != 0 && $res != -1) {
+	unlink $tmpfile;
+	return ($ERROR, "crashed: $cmd");
     }
-    return ($OK, \%sh);
+    File::Copy::move($tmpfile, $cfile);
+    return $OK;
 }
 
 1;
@@ -33,11 +33,10 @@ sub advance ($$$) {
     return \$index;
 }
 
-sub transform ($$$) {
-    (my $cfile, my $which, my $state) = @_;
+sub transform_text ($$$) {
+    (my $prog, my $which, my $state) = @_;
     my $index = ${$state};
 
-    my $prog = read_file ($cfile);
     my $prog2 = $prog;
 
     $replace_cont = -1;
@@ -61,12 +60,30 @@ sub transform ($$$) {
     } else {
 	die;
     }
-    
+    return $prog2;
+}
+
+sub transform ($$$) {
+    (my $cfile, my $which, my $state) = @_;
+
+    my $prog = read_file ($cfile);
+    my $prog2 = transform_text ($prog, $which, $state);
     if ($prog ne $prog2) {
 	write_file ($cfile, $prog2);
-	return ($OK, \$index);
+	return ($OK, $state);
+    } else {
+	return ($STOP, $state);
+    }
+}
+
+sub transform_edit ($$$) {
+    (my $prog, my $which, my $state) = @_;
+
+    my $prog2 = transform_text ($prog, $which, $state);
+    if ($prog ne $prog2) {
+	return ($OK, $state, [ text_edit ($prog, $prog2) ]);
     } else {
-	return ($STOP, \$index);
+	return ($STOP, $state, []);
     }
 }
 
@@ -48,124 +48,73 @@ sub check_prereqs () {
     return 0;
 }
 
-# unlike the previous version of pass_lines, this one always
-# progresses from the back of the file to the front
-
-sub new ($$) {
-    (my $cfile, my $arg) = @_;
-    my %sh;
-    $sh{"start"} = 1;
-    return \%sh;
-}
-
-sub advance ($$$) {
-    (my $cfile, my $which, my $state) = @_;
-    my %sh = %{$state};
-    die if (defined($sh{"start"}));
-    my $pos = $sh{"index"};
-    $sh{"index"} -= $sh{"chunk"};
-    my $i = $sh{"index"};
-    my $c = $sh{"chunk"};
-    print "***ADVANCE*** from $pos to $i with chunk $c\n" if $DEBUG;
-    return \%sh;
-}
-
-sub transform ($$$) {
-    (my $cfile, my $arg, my $state) = @_;
-    my %sh = %{$state};
-
-    if (defined($sh{"start"})) {
-	print "***TRANSFORM START***\n" if $DEBUG;
-	delete $sh{"start"};
-	my $outfile = File::Temp::tmpnam();
-	my $cmd = qq{"$topformflat" $arg < $cfile > $outfile};
-	print $cmd if $DEBUG;
-	runit ($cmd);
-
-	my $tmpfile = File::Temp::tmpnam();
-	open INF_BLANK, "<$outfile" or die;
-	open OUTF_BLANK, ">$tmpfile" or die;
-	while (my $line = <INF_BLANK>) {
-		if($line !~ /^\s*$/) {
-			print OUTF_BLANK $line;
-		}
-	}
-	close INF_BLANK;
-	close OUTF_BLANK;
-
-	if (compare($cfile, $tmpfile) == 0) {
-	    # this is a gross hack to avoid tripping the
-	    # pass-didn't-modify-file check in the C-Reduce core, in
-	    # the (generally unlikely) case where topformflat didn't
-	    # change the file at all
-	    print "gross blank line hack!\n" if $DEBUG;
-	    open OF, ">>$tmpfile" or die;
-	    print OF "\n";
-	    close OF;
-	}
-	File::Copy::move($tmpfile, $cfile);
-	open INF, "<$cfile" or die;
-	my @data = ();
-	while (my $line = <INF>) {
-	    push @data, $line;
-	}
-	close INF;
-	my $l = scalar(@data);
-	$sh{"index"} = $l;
-	$sh{"chunk"} = $l;
-	return ($OK, \%sh);
-    }
-
-    if ($DEBUG) {
-	my $c = $sh{"chunk"};
-	my $i = $sh{"index"};
-	print "***TRANSFORM REGULAR chunk $c at $i***\n";
-    }
+# Lines are removed by the ddmin scheduler in creduce_ddmin.pm, from
+# the back of the file to the front, after the file has been flattened
+# by topformflat to the nesting depth given as the pass argument.
 
+sub read_lines ($) {
+    (my $cfile) = @_;
     open INF, "<$cfile" or die;
     my @data = ();
     while (my $line = <INF>) {
 	push @data, $line;
-	if ($DEBUG && 0) {
-	    chomp $line;
-	    print "LINE PASS FILE DATA: '$line'\n";
-	}
     }
     close INF;
+    return @data;
+}
 
-  AGAIN:
-    $sh{"index"} = scalar(@data) if ($sh{"index"} > scalar(@data));
-    if ($sh{"index"} >= 0 && scalar(@data) > 0 && $sh{"chunk"} > 0) {
-	my $start = $sh{"index"} - $sh{"chunk"};
-	$start = 0 if ($start < 0);
-	my $lines = scalar(@data);
-	splice @data, $start, $sh{"chunk"};
-	my $newlines = scalar(@data);
-	my $c = $sh{"chunk"};
-	print "went from $lines lines to $newlines with chunk $c\n" if $DEBUG;
-	my $tmpfile = File::Temp::tmpnam();
-	open OUTF, ">$tmpfile" or die;
-	foreach my $line (@data) {
-	    print OUTF $line;
-	}
-	close OUTF;
-	if (compare($cfile, $tmpfile) == 0) {
-	    print "did not change file\n" if $DEBUG;
-	    unlink $tmpfile;
-	    $sh{"index"} -= $sh{"chunk"};
-	    goto AGAIN;
+sub range_prepare ($$) {
+    (my $cfile, my $arg) = @_;
+    my $outfile = File::Temp::tmpnam();
+    my $cmd = qq{"$topformflat" $arg < $cfile > $outfile};
+    print $cmd if $DEBUG;
+    runit ($cmd);
+
+    my $tmpfile = File::Temp::tmpnam();
+    open INF_BLANK, "<$outfile" or die;
+    open OUTF_BLANK, ">$tmpfile" or die;
+    while (my $line = <INF_BLANK>) {
+	if($line !~ /^\s*$/) {
+	    print OUTF_BLANK $line;
 	}
-	File::Copy::move($tmpfile, $cfile);
-    } else {
-	return ($STOP, \%sh) if ($sh{"chunk"} <= 1);
-	my $newchunk = int ($sh{"chunk"} / 2.0);
-	$sh{"chunk"} = $newchunk;
-	print "granularity reduced to $newchunk\n" if $DEBUG;
-	$sh{"index"} = scalar(@data);
-	goto AGAIN;
     }
+    close INF_BLANK;
+    close OUTF_BLANK;
+    unlink $outfile;
+
+    if (compare($cfile, $tmpfile) == 0) {
+	unlink $tmpfile;
+	return 0;
+    }
+    File::Copy::move($tmpfile, $cfile);
+    return 1;
+}
+
+sub range_count ($$) {
+    (my $cfile, my $arg) = @_;
+    return scalar (read_lines ($cfile));
+}
 
-    return ($OK, \%sh);
+sub range_apply ($$$$) {
+    (my $cfile, my $arg, my $from, my $to) = @_;
+    my @data = read_lines ($cfile);
+    return $STOP if ($from >= scalar(@data));
+    my $lines = scalar(@data);
+    splice @data, $from, $to - $from;
+    my $newlines = scalar(@data);
+    print "went from $lines lines to $newlines\n" if $DEBUG;
+    my $tmpfile = File::Temp::tmpnam();
+    open OUTF, ">$tmpfile" or die;
+    foreach my $line (@data) {
+	print OUTF $line;
+    }
+    close OUTF;
+    if (compare($cfile, $tmpfile) == 0) {
+	unlink $tmpfile;
+	return $STOP;
+    }
+    File::Copy::move($tmpfile, $cfile);
+    return $OK;
 }
 
 1;